@@ -0,0 +1,34 @@
+# Packs and unpacks small values in a loop, the case where per-call setup
+# of compressor state and output buffers dominates.
+#
+#   ruby -Ilib bench/pack_small.rb [iterations]
+require 'packsnap'
+require 'benchmark'
+
+n = (ARGV[0] || 1_000_000).to_i
+
+message = {
+  "id" => 12345, "type" => "event", "user" => "someone@example.com",
+  "tags" => %w[alpha beta gamma], "payload" => "x" * 200,
+}
+
+cases = [
+  ['pack("value")', lambda { Packsnap.pack("value") }],
+  ['pack(message)', lambda { Packsnap.pack(message) }],
+  ['pack(message, codec: :lz4)', lambda { Packsnap.pack(message, codec: :lz4) }],
+  ['pack(message, codec: :zstd)', lambda { Packsnap.pack(message, codec: :zstd) }],
+]
+
+zstd = Packsnap.pack(message, codec: :zstd, compress_threshold: 0) rescue nil
+cases << ['unpack(zstd message)', lambda { Packsnap.unpack(zstd) }] if zstd
+
+Benchmark.bm(28) do |x|
+  cases.each do |label, block|
+    begin
+      block.call
+    rescue ArgumentError
+      next  # codec not built
+    end
+    x.report(label) { n.times { block.call } }
+  end
+end
@@ -0,0 +1,28 @@
+# Decodes the objects in spec/cases.msg over and over and reports the cost
+# per object, which is dominated by dispatching on the head byte. The
+# corpus is repeated inside one array so that method calls don't count.
+#
+#   ruby -Ilib bench/unpack_cases.rb [iterations]
+require 'packsnap'
+require 'benchmark'
+
+n = (ARGV[0] || 2_000).to_i
+repeat = 1000
+
+corpus = File.binread(File.expand_path('../../spec/cases.msg', __FILE__))
+count = 0
+Packsnap::Unpacker.new.feed_each(corpus) { count += 1 }
+count *= repeat
+data = [0xdd, count].pack('CN') + corpus * repeat
+
+unpacker = Packsnap::Unpacker.new
+cases = [
+  ['read', lambda { unpacker.feed(data); unpacker.read }],
+  ['skip', lambda { unpacker.feed(data); unpacker.skip }],
+]
+
+cases.each do |label, block|
+  block.call
+  t = Benchmark.realtime { n.times { block.call } }
+  printf("%-6s %8.1f ns/object\n", label, t * 1e9 / (n * count))
+end
@@ -2,22 +2,31 @@ module Packsnap
   #
   # Serializes an object into an IO or String.
   #
-  # @overload dump(obj)
+  # The data is wrapped in an envelope recording the format version, the
+  # codec and the uncompressed length. Payloads shorter than
+  # :compress_threshold, or which the codec can't shrink, are stored as is.
+  #
+  # When an IO is given, the data is written as a framed stream: a sequence
+  # of blocks each prefixed with its 4-byte big-endian length.
+  #
+  # @overload dump(obj, options={})
   #   @return [String] serialized data
   #
-  # @overload dump(obj, io)
+  # @overload dump(obj, io, options={})
   #   @return [IO]
   #
+  # See Buffer#initialize for supported options.
+  #
   def self.dump(arg)
   end
 
   #
   # Serializes an object into an IO or String. Alias of dump.
   #
-  # @overload dump(obj)
+  # @overload dump(obj, options={})
   #   @return [String] serialized data
   #
-  # @overload dump(obj, io)
+  # @overload dump(obj, io, options={})
   #   @return [IO]
   #
   def self.pack(arg)
@@ -25,11 +34,38 @@ module Packsnap
 
   #
   # Deserializes an object from an IO or String.
-  #
-  # @overload load(string)
+  # An IO is read as a framed stream written by dump(obj, io).
+  #
+  # It's safe to call from multiple threads and fibers at once: each
+  # fiber reuses its own unpacker.
+  #
+  # See Unpacker#initialize for supported options. With *:lazy* => true,
+  # a map or an array in a String is returned as a LazyMap or a LazyArray
+  # which decodes its elements only when they're accessed. Adding
+  # *:tape* => true validates the data and records where every value
+  # starts and ends in one pass up front; the views then find elements
+  # by jumping along this tape instead of skipping over the bytes before
+  # them, which pays off for deep paths and for many lookups. Without a
+  # tape the object is skipped over once up front, so that extra bytes
+  # after it raise as they do without *:lazy*. *:lazy* can't be combined
+  # with *:symbolize_keys* or *:intern_values*.
+  #
+  # *:only* takes an Array of key paths and decodes only the values on
+  # them, skipping everything else. A path element is a map key, an array
+  # index or :* for every key or element; the selected values are decoded
+  # as a whole:
+  #
+  #   Packsnap.unpack(data, only: [["user", "id"], ["items", :*, "sku"]])
+  #   # => {"user"=>{"id"=>1}, "items"=>[{"sku"=>"a"}, {"sku"=>"b"}]}
+  #
+  # With *:validate* => true, the whole structure in a String is checked
+  # as by valid? before any object is created, so malformed input raises
+  # without allocating the objects that precede the broken part.
+  #
+  # @overload load(string, options={})
   #   @param string [String] data to deserialize
   #
-  # @overload load(io)
+  # @overload load(io, options={})
   #   @param io [IO]
   #
   # @return [Object] deserialized object
@@ -40,15 +76,57 @@ module Packsnap
   #
   # Deserializes an object from an IO or String. Alias of load.
   #
-  # @overload unpack(string)
+  # @overload unpack(string, options={})
   #   @param string [String] data to deserialize
   #
-  # @overload unpack(io)
+  # @overload unpack(io, options={})
   #   @param io [IO]
   #
   # @return [Object] deserialized object
   #
   def self.unpack(arg)
   end
-end
 
+  #
+  # Checks whether a String holds exactly one well-formed object, without
+  # creating any Ruby object: lengths and counts must fit in the data,
+  # no invalid byte may appear and containers may nest at most
+  # :max_depth deep. A broken envelope or compressed data makes it false
+  # as well.
+  #
+  # @overload valid?(string, options={})
+  #   @param string [String] serialized data
+  #
+  # @return [Boolean]
+  #
+  def self.valid?(string)
+  end
+
+  #
+  # Trains a compression dictionary for small messages which share
+  # structure, such as key names. Each sample is serialized with
+  # MessagePack and the dictionary is built from the serialized bytes.
+  # Requires the extension to be built with zstd.
+  #
+  # @param samples [Array] objects like the ones that will be packed
+  # @param size [Integer] maximum size of the dictionary in bytes
+  # @return [String] the dictionary
+  #
+  def self.train_dictionary(samples, size=16384)
+  end
+
+  #
+  # Registers a dictionary under _id_. Pack with
+  # codec: :zstd, dictionary: id to use it. The id is recorded in the
+  # output, and unpack looks the dictionary up by that id, so both sides
+  # must register the same dictionary under the same id.
+  #
+  # Registering another dictionary under a taken id raises ArgumentError.
+  #
+  # @param id [Integer]
+  # @param dictionary [String]
+  # @return [Integer] id
+  #
+  def self.register_dictionary(id, dictionary)
+  end
+end
@@ -13,6 +13,10 @@ module Packsnap
     #   This buffer writes written data into the IO when it is filled.
     #   This buffer reads data from the IO when it is empty.
     #
+    # Large data is compressed and decompressed without the GVL. Meanwhile
+    # methods of the buffer, and of the Packer or Unpacker which owns it,
+    # raise ThreadError when called from another thread.
+    #
     # _io_ must respond to readpartial(length, [,string]) or read(string) method and
     # write(string) or append(string) method.
     #
@@ -21,6 +25,11 @@ module Packsnap
     # * *:io_buffer_size* buffer size to read data from the internal IO. (default: 32768)
     # * *:read_reference_threshold* the threshold size to enable zero-copy deserialize optimization. Read strings longer than this threshold will refer the original string instead of copying it. (default: 256) (supported in MRI only)
     # * *:write_reference_threshold* the threshold size to enable zero-copy serialize optimization. The buffer refers written strings longer than this threshold instead of copying it. (default: 524288) (supported in MRI only)
+    # * *:compress_threshold* payloads shorter than this are stored uncompressed. (default: 64)
+    # * *:codec* compression codec, one of :snappy, :lz4, :zstd or :none. lz4 and zstd are available when the extension was built with liblz4 and libzstd. (default: :snappy)
+    # * *:dictionary* id of a dictionary registered with Packsnap.register_dictionary to compress with. Supported by :zstd.
+    # * *:level* compression level of the codec; the acceleration factor for :lz4. 0 selects the codec's default. (default: 0)
+    # * *:framed* compress data written to the IO as a stream of length-prefixed blocks of up to 64KB each. (default: false)
     #
     def initialize(*args)
     end
@@ -0,0 +1,40 @@
+module Packsnap
+
+  #
+  # Packsnap::LazyArray is a read-only view of an array returned by
+  # Packsnap.unpack(data, lazy: true).
+  #
+  # It keeps the decompressed data and decodes elements only when they're
+  # accessed. Nested maps and arrays are returned as LazyMap and
+  # LazyArray. Decoded elements are cached by the view.
+  #
+  class LazyArray
+    include Enumerable
+
+    #
+    # Returns the element at _index_, or nil if out of range.
+    # A negative _index_ counts from the end.
+    #
+    # @param index [Integer]
+    # @return [Object]
+    #
+    def [](index)
+    end
+
+    #
+    # @return [Integer] number of elements
+    #
+    def size
+    end
+
+    alias length size
+
+    #
+    # @yieldparam element [Object]
+    # @return [LazyArray] self
+    #
+    def each(&block)
+    end
+  end
+
+end
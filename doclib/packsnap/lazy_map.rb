@@ -0,0 +1,64 @@
+module Packsnap
+
+  #
+  # Packsnap::LazyMap is a read-only view of a map returned by
+  # Packsnap.unpack(data, lazy: true).
+  #
+  # It keeps the decompressed data and decodes keys and values only when
+  # they're accessed. Nested maps and arrays are returned as LazyMap and
+  # LazyArray. Decoded values are cached by the view.
+  #
+  # Malformed data raises Packsnap::UnpackError or EOFError when the
+  # broken part is accessed, instead of when the data is unpacked.
+  #
+  class LazyMap
+    include Enumerable
+
+    #
+    # Returns the value of _key_, or nil if not found.
+    # A String or Symbol _key_ is compared with the bytes of string keys
+    # without decoding them.
+    #
+    # @param key [Object]
+    # @return [Object]
+    #
+    def [](key)
+    end
+
+    #
+    # @param key [Object]
+    # @return [Boolean]
+    #
+    def key?(key)
+    end
+
+    alias has_key? key?
+    alias include? key?
+
+    #
+    # @return [Array] decoded keys
+    #
+    def keys
+    end
+
+    #
+    # @return [Integer] number of entries
+    #
+    def size
+    end
+
+    alias length size
+
+    #
+    # Yields each [key, value] pair.
+    #
+    # @yieldparam pair [Array]
+    # @return [LazyMap] self
+    #
+    def each(&block)
+    end
+
+    alias each_pair each
+  end
+
+end
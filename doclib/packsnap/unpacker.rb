@@ -17,7 +17,18 @@ module Packsnap
     #   This unpacker reads data from the _io_ to fill the internal buffer.
     #   _io_ must respond to readpartial(length [,string]) or read(length [,string]) method.
     #
-    # See Buffer#initialize for supported options.
+    # See Buffer#initialize for supported options. With the *:framed* option,
+    # data given to _feed_ or read from the _io_ is a stream of length-prefixed
+    # compressed blocks (as written by Packsnap.pack(obj, io)) and each block is
+    # decompressed as soon as it is complete.
+    #
+    # Map keys up to 64 bytes are interned in a bounded table kept by the
+    # unpacker: a repeated key is returned as the same frozen String.
+    # Following options are supported:
+    #
+    # * *:intern_values* interns String values up to 64 bytes as well, which saves memory for repetitive values but returns them frozen
+    # * *:symbolize_keys* returns String keys of maps as Symbols, built from the key bytes through a bounded cache like the one above. Names not already in use become Symbols which GC can collect.
+    # * *:max_depth* the deepest nesting of arrays and maps to decode. Deeper data raises Packsnap::StackError. The stack starts small and grows up to this depth. (default: 128)
     #
     def initialize(*args)
     end
@@ -89,9 +100,103 @@ module Packsnap
     def read_map_header
     end
 
+    #
+    # Returns the type of the next object without reading it:
+    # :nil, :boolean, :integer, :float, :raw, :array or :map.
+    #
+    # If there're not enough buffer, this method raises EOFError.
+    #
+    # @return [Symbol]
+    #
+    def peek_next_type
+    end
+
+    #
+    # Reads an Integer. With read_float, read_bool, read_string_into and
+    # the header readers, it lets a reader which knows the layout of
+    # records stream them field by field, without building the Hashes
+    # and Arrays _read_ would return.
+    #
+    # If the next object is of another type, it raises Packsnap::TypeError
+    # and leaves the object to be read.
+    # If there're not enough buffer, this method raises EOFError.
+    #
+    # @return [Integer]
+    #
+    def read_int
+    end
+
+    #
+    # Reads a Float. Raises the same errors as read_int.
+    #
+    # @return [Float]
+    #
+    def read_float
+    end
+
+    #
+    # Reads true or false. Raises the same errors as read_int.
+    #
+    # @return [Boolean]
+    #
+    def read_bool
+    end
+
+    #
+    # Reads a raw into _buffer_, replacing its content, so that a String
+    # can be reused for every record. The encoding of _buffer_ is kept.
+    # Raises the same errors as read_int; after EOFError, calling it again
+    # with the same _buffer_ resumes reading. Passing another String
+    # meanwhile, or calling it after _read_ raised EOFError in a raw,
+    # raises ArgumentError.
+    #
+    # @param buffer [String]
+    # @return [String] buffer
+    #
+    def read_string_into(buffer)
+    end
+
+    #
+    # Reads an array of maps, such as rows of records, as columns: a Hash
+    # from each key of the maps to an Array of its values in row order,
+    # with nil where a row lacks the key. No Hash is created per row, and
+    # rows repeating the keys of the previous row in the same order find
+    # their columns without a lookup.
+    #
+    # If the next object isn't an array of maps, it raises
+    # Packsnap::TypeError; an array is skipped. If there're not enough
+    # buffer, it raises EOFError and consumes nothing, so it can be called
+    # again after feeding more data.
+    #
+    # @return [Hash]
+    #
+    def read_columns
+    end
+
+    #
+    # Reads an array or a map into _target_, an Array or a Hash, instead of
+    # a new one, and returns _target_. Entries the object doesn't have are
+    # removed, and the unfrozen Arrays and Hashes already at the same index
+    # or key are refilled in turn. Strings are always new, so those taken
+    # from a previous message keep their content. A consumer decoding
+    # messages of the same shape over and over can keep one target and
+    # create little garbage.
+    #
+    # If the next object isn't of the type of _target_, it raises
+    # Packsnap::TypeError and leaves the object to be read. If there're not
+    # enough buffer, it raises EOFError and leaves _target_ untouched, so
+    # it can be called again after feeding more data.
+    #
+    # @param target [Array, Hash]
+    # @return [Array, Hash] target
+    #
+    def read_into(target)
+    end
+
     #
     # Appends data into the internal buffer.
-    # This method calls buffer.append(data).
+    # This method calls buffer.append(data), or decompresses complete blocks
+    # into the buffer if the *:framed* option is set.
     #
     # @param data [String]
     # @return [Unpacker] self
@@ -17,8 +17,15 @@
  */
 
 #include "snappy.h"
+#include "packsnap.h"
 #include "buffer.hh"
 #include "rmem.h"
+#include "pool.hh"
+#include <new>
+
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+#include <ruby/thread.h>
+#endif
 
 #ifdef RUBY_VM
 #define HAVE_RB_STR_REPLACE
@@ -32,6 +39,379 @@ static ID s_replace;
 static msgpack_rmem_t s_rmem;
 #endif
 
+/*
+ * snappy::Source reading up to _length_ bytes from the chunk list
+ * without consuming them. Compression reads straight from the chunks
+ * so the buffer doesn't need to be concatenated first.
+ * The source is copyable to read the same data again.
+ */
+class msgpack_buffer_source_t : public snappy::Source {
+public:
+    msgpack_buffer_source_t(const msgpack_buffer_t* b, size_t length) :
+        chunk(b->head), tail(&b->tail),
+        ptr(b->read_buffer), last(b->head->last), remaining(length) { }
+
+    /* contiguous memory */
+    msgpack_buffer_source_t(const char* data, size_t length) :
+        chunk(NULL), tail(NULL),
+        ptr(data), last(data + length), remaining(length) { }
+
+    msgpack_buffer_source_t() :
+        chunk(NULL), tail(NULL), ptr(NULL), last(NULL), remaining(0) { }
+
+    size_t Available() const
+    {
+        return remaining;
+    }
+
+    const char* Peek(size_t* len)
+    {
+        size_t avail = last - ptr;
+        while(avail == 0 && chunk != tail) {
+            chunk = chunk->next;
+            ptr = chunk->first;
+            last = chunk->last;
+            avail = last - ptr;
+        }
+        *len = avail < remaining ? avail : remaining;
+        return ptr;
+    }
+
+    void Skip(size_t n)
+    {
+        ptr += n;
+        remaining -= n;
+    }
+
+    /* returns a source of the next _length_ bytes and skips them */
+    msgpack_buffer_source_t Split(size_t length)
+    {
+        msgpack_buffer_source_t head(*this);
+        head.remaining = length;
+        while(length > 0) {
+            size_t n;
+            Peek(&n);
+            if(n > length) {
+                n = length;
+            }
+            Skip(n);
+            length -= n;
+        }
+        return head;
+    }
+
+    size_t CopyTo(char* dst)
+    {
+        size_t total = 0;
+        while(remaining > 0) {
+            size_t n;
+            const char* p = Peek(&n);
+            memcpy(dst + total, p, n);
+            Skip(n);
+            total += n;
+        }
+        return total;
+    }
+
+private:
+    const msgpack_buffer_chunk_t* chunk;
+    const msgpack_buffer_chunk_t* tail;
+    const char* ptr;
+    const char* last;
+    size_t remaining;
+};
+
+
+/*
+ * envelope
+ * +-------+---------+-------+---------------+---------+
+ * | magic | version | codec | varint length | payload |
+ * +-------+---------+-------+---------------+---------+
+ *
+ * _length_ is the size of the uncompressed payload. Input that doesn't
+ * start with a valid envelope is decoded as plain snappy.
+ *
+ * With MSGPACK_ENVELOPE_FLAG_DICTIONARY set in the codec byte, _length_ is
+ * followed by the varint id of the dictionary the payload was compressed
+ * with.
+ *
+ * Large payloads are split into blocks compressed independently, so that
+ * they can be compressed and decompressed in parallel. The codec byte has
+ * MSGPACK_ENVELOPE_FLAG_BLOCKS set and the payload is:
+ * +-------------------+------------------------------------+--------+
+ * | varint block size | (codec, varint compressed size) * n | blocks |
+ * +-------------------+------------------------------------+--------+
+ *
+ * Each block but the last holds _block size_ bytes of input. A block whose
+ * codec is MSGPACK_CODEC_NONE is stored.
+ */
+#define ENVELOPE_HEADER_MAX (3 + 10 + 10)
+
+#define ENVELOPE_CODEC_MASK 0x0f
+#define ENVELOPE_FLAGS_MASK (MSGPACK_ENVELOPE_FLAG_DICTIONARY | MSGPACK_ENVELOPE_FLAG_BLOCKS)
+#define ENVELOPE_BLOCK_ENTRY_MAX (1 + 10)
+
+/* a frame may hold any compiled codec */
+#define FRAME_COMPRESSED_LENGTH_MAX \
+    (ENVELOPE_HEADER_MAX + msgpack_codec_max_compressed_length(MSGPACK_BUFFER_FRAME_BLOCK_SIZE))
+
+static inline char* _msgpack_buffer_write_varint(char* p, size_t v)
+{
+    while(v >= 0x80) {
+        *p++ = (char) (v | 0x80);
+        v >>= 7;
+    }
+    *p++ = (char) v;
+    return p;
+}
+
+static inline const char* _msgpack_buffer_read_varint(const char* p, const char* end, size_t* result)
+{
+    size_t v = 0;
+    for(unsigned int shift = 0; p < end && shift < 64; shift += 7) {
+        unsigned int byte = (unsigned char) *p++;
+        v |= (size_t) (byte & 0x7f) << shift;
+        if((byte & 0x80) == 0) {
+            *result = v;
+            return p;
+        }
+    }
+    return NULL;
+}
+
+static inline bool _msgpack_buffer_envelope_uses_blocks(const msgpack_buffer_t* b, size_t length)
+{
+    return b->codec != NULL && length >= MSGPACK_BUFFER_PARALLEL_THRESHOLD;
+}
+
+static inline size_t _msgpack_buffer_block_count(size_t length)
+{
+    return (length + MSGPACK_BUFFER_PARALLEL_BLOCK_SIZE - 1) / MSGPACK_BUFFER_PARALLEL_BLOCK_SIZE;
+}
+
+static inline size_t _msgpack_buffer_envelope_capacity(const msgpack_buffer_t* b, size_t length)
+{
+    if(b->codec == NULL) {
+        return ENVELOPE_HEADER_MAX + length;
+    }
+    if(_msgpack_buffer_envelope_uses_blocks(b, length)) {
+        size_t count = _msgpack_buffer_block_count(length);
+        size_t last = length - (count - 1) * MSGPACK_BUFFER_PARALLEL_BLOCK_SIZE;
+        return ENVELOPE_HEADER_MAX + 10 + count * ENVELOPE_BLOCK_ENTRY_MAX +
+            (count - 1) * b->codec->max_compressed_length(MSGPACK_BUFFER_PARALLEL_BLOCK_SIZE) +
+            b->codec->max_compressed_length(last);
+    }
+    return ENVELOPE_HEADER_MAX + b->codec->max_compressed_length(length);
+}
+
+struct msgpack_buffer_block_t {
+    msgpack_buffer_source_t source;
+    char* dst;
+    size_t size;
+    int codec;
+};
+
+struct msgpack_buffer_blocks_t {
+    const msgpack_codec_t* codec;
+    int level;
+    const msgpack_codec_dictionary_t* dict;
+    msgpack_buffer_block_t* blocks;
+};
+
+static void _msgpack_buffer_compress_block(void* data, size_t index)
+{
+    msgpack_buffer_blocks_t* bs = (msgpack_buffer_blocks_t*) data;
+    msgpack_buffer_block_t* block = &bs->blocks[index];
+
+    size_t length = block->source.Available();
+    msgpack_buffer_source_t source(block->source);
+    size_t size = bs->codec->compress(&source, block->dst, bs->level, bs->dict);
+    if(size > 0 && size < length) {
+        block->codec = bs->codec->id;
+        block->size = size;
+    } else {
+        msgpack_buffer_source_t source(block->source);
+        block->codec = MSGPACK_CODEC_NONE;
+        block->size = source.CopyTo(block->dst);
+    }
+}
+
+/* returns 0 if there's no memory for the list of blocks */
+static size_t _msgpack_buffer_write_blocks(const msgpack_buffer_t* b,
+        const msgpack_buffer_source_t& payload, const msgpack_codec_dictionary_t* dict,
+        char* header, char* p)
+{
+    size_t length = payload.Available();
+    size_t count = _msgpack_buffer_block_count(length);
+    size_t max_block = b->codec->max_compressed_length(MSGPACK_BUFFER_PARALLEL_BLOCK_SIZE);
+
+    /* runs without the GVL: no exception may be thrown */
+    msgpack_buffer_block_t* blocks = new (std::nothrow) msgpack_buffer_block_t[count];
+    if(blocks == NULL) {
+        return 0;
+    }
+
+    /* compress each block at its worst-case offset after the directory */
+    char* base = p + 10 + count * ENVELOPE_BLOCK_ENTRY_MAX;
+    msgpack_buffer_source_t rest(payload);
+    for(size_t i = 0; i < count; i++) {
+        size_t n = rest.Available() < MSGPACK_BUFFER_PARALLEL_BLOCK_SIZE ?
+            rest.Available() : MSGPACK_BUFFER_PARALLEL_BLOCK_SIZE;
+        blocks[i].source = rest.Split(n);
+        blocks[i].dst = base + i * max_block;
+    }
+
+    msgpack_buffer_blocks_t bs = { b->codec, b->codec_level, dict, blocks };
+    msgpack_pool_run(_msgpack_buffer_compress_block, &bs, count);
+
+    /* write the directory and pack the blocks behind it */
+    p = _msgpack_buffer_write_varint(p, MSGPACK_BUFFER_PARALLEL_BLOCK_SIZE);
+    for(size_t i = 0; i < count; i++) {
+        *p++ = (char) blocks[i].codec;
+        p = _msgpack_buffer_write_varint(p, blocks[i].size);
+    }
+    for(size_t i = 0; i < count; i++) {
+        memmove(p, blocks[i].dst, blocks[i].size);
+        p += blocks[i].size;
+    }
+    delete[] blocks;
+
+    *header |= (char) (b->codec->id | MSGPACK_ENVELOPE_FLAG_BLOCKS);
+    return p - (header - 2);
+}
+
+static size_t _msgpack_buffer_write_envelope(const msgpack_buffer_t* b,
+        const msgpack_buffer_source_t& payload, char* dst)
+{
+    /* dst has _msgpack_buffer_envelope_capacity(b, length) bytes */
+    size_t length = payload.Available();
+
+    char* p = dst;
+    *p++ = (char) MSGPACK_ENVELOPE_MAGIC;
+    *p++ = (char) (0x80 | MSGPACK_ENVELOPE_VERSION);
+    char* codec = p++;
+    p = _msgpack_buffer_write_varint(p, length);
+
+    *codec = 0;
+    const msgpack_codec_dictionary_t* dict = NULL;
+    if(b->dictionary != NULL && b->codec != NULL && length >= b->compress_threshold) {
+        dict = b->dictionary;
+        *codec = MSGPACK_ENVELOPE_FLAG_DICTIONARY;
+        p = _msgpack_buffer_write_varint(p, dict->id);
+    }
+
+    if(_msgpack_buffer_envelope_uses_blocks(b, length)) {
+        size_t n = _msgpack_buffer_write_blocks(b, payload, dict, codec, p);
+        if(n > 0) {
+            return n;
+        }
+        /* no memory for the blocks: compress the payload as one. the
+         * space for the directory covers the bound of the whole payload */
+    }
+
+    if(b->codec != NULL && length >= b->compress_threshold) {
+        msgpack_buffer_source_t source(payload);
+        size_t compressed_length = b->codec->compress(&source, p, b->codec_level, dict);
+        if(compressed_length > 0 && compressed_length < length) {
+            *codec |= (char) b->codec->id;
+            return (p - dst) + compressed_length;
+        }
+    }
+
+    /* too small or incompressible */
+    *codec |= MSGPACK_CODEC_NONE;
+    msgpack_buffer_source_t source(payload);
+    return (p - dst) + source.CopyTo(p);
+}
+
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+struct msgpack_buffer_nogvl_args_t {
+    msgpack_buffer_t* b;
+    void* (*func)(void*);
+    void* data;
+};
+
+static VALUE _msgpack_buffer_nogvl_call(VALUE data)
+{
+    msgpack_buffer_nogvl_args_t* args = (msgpack_buffer_nogvl_args_t*) data;
+    rb_thread_call_without_gvl(args->func, args->data, NULL, NULL);
+    return Qnil;
+}
+
+static VALUE _msgpack_buffer_nogvl_done(VALUE data)
+{
+    ((msgpack_buffer_nogvl_args_t*) data)->b->nogvl = false;
+    return Qnil;
+}
+#endif
+
+/*
+ * Compression of large buffers runs without the GVL. It only touches
+ * memory that stays valid meanwhile: C memory, and strings referenced
+ * by the buffer or frozen by the caller. Other threads can't use the
+ * buffer meanwhile: see msgpack_buffer_check_nogvl.
+ */
+static inline void _msgpack_buffer_call_without_gvl(msgpack_buffer_t* b,
+        void* (*func)(void*), void* data, size_t length)
+{
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+    if(length >= MSGPACK_BUFFER_NOGVL_THRESHOLD) {
+        /* other threads calling methods of the owner raise meanwhile.
+         * pending interrupts may raise once the GVL is taken back */
+        msgpack_buffer_nogvl_args_t args = { b, func, data };
+        b->nogvl = true;
+        rb_ensure(_msgpack_buffer_nogvl_call, (VALUE) &args,
+                _msgpack_buffer_nogvl_done, (VALUE) &args);
+        return;
+    }
+#else
+    UNUSED(b);
+    UNUSED(length);
+#endif
+    func(data);
+}
+
+struct msgpack_buffer_envelope_args_t {
+    const msgpack_buffer_t* b;
+    const msgpack_buffer_source_t* payload;
+    char* dst;
+    size_t result;
+};
+
+static void* _msgpack_buffer_write_envelope_func(void* data)
+{
+    msgpack_buffer_envelope_args_t* args = (msgpack_buffer_envelope_args_t*) data;
+    args->result = _msgpack_buffer_write_envelope(args->b, *args->payload, args->dst);
+    return NULL;
+}
+
+struct msgpack_buffer_decompress_args_t {
+    const msgpack_codec_t* codec;
+    const msgpack_codec_dictionary_t* dict;
+    const char* src;
+    size_t src_length;
+    char* dst;
+    size_t length;
+    bool result;
+};
+
+static void* _msgpack_buffer_decompress_func(void* data)
+{
+    msgpack_buffer_decompress_args_t* args = (msgpack_buffer_decompress_args_t*) data;
+    args->result = args->codec->decompress(args->src, args->src_length,
+            args->dst, args->length, args->dict);
+    return NULL;
+}
+
+static bool _msgpack_buffer_decompress(msgpack_buffer_t* b, const msgpack_codec_t* codec,
+        const msgpack_codec_dictionary_t* dict,
+        const char* src, size_t src_length, char* dst, size_t length)
+{
+    msgpack_buffer_decompress_args_t args = { codec, dict, src, src_length, dst, length, false };
+    _msgpack_buffer_call_without_gvl(b, _msgpack_buffer_decompress_func, &args, length);
+    return args.result;
+}
+
 void msgpack_buffer_static_init()
 {
 #ifndef DISABLE_RMEM
@@ -54,11 +434,20 @@ void msgpack_buffer_init(msgpack_buffer_t* b)
     memset(b, 0, sizeof(msgpack_buffer_t));
 
     b->head = &b->tail;
+    msgpack_buffer_reset_options(b);
+    b->io = Qnil;
+    b->io_buffer = Qnil;
+}
+
+void msgpack_buffer_reset_options(msgpack_buffer_t* b)
+{
     b->write_reference_threshold = MSGPACK_BUFFER_STRING_WRITE_REFERENCE_DEFAULT;
     b->read_reference_threshold = MSGPACK_BUFFER_STRING_READ_REFERENCE_DEFAULT;
     b->io_buffer_size = MSGPACK_BUFFER_IO_BUFFER_SIZE_DEFAULT;
-    b->io = Qnil;
-    b->io_buffer = Qnil;
+    b->compress_threshold = MSGPACK_BUFFER_COMPRESS_THRESHOLD_DEFAULT;
+    msgpack_buffer_set_codec(b, msgpack_codec_get(MSGPACK_CODEC_SNAPPY), 0);
+    b->dictionary = NULL;
+    b->framed = false;
 }
 
 static void _msgpack_buffer_chunk_destroy(msgpack_buffer_chunk_t* c)
@@ -97,6 +486,8 @@ void msgpack_buffer_destroy(msgpack_buffer_t* b)
         free(c);
         c = n;
     }
+
+    free(b->frame_buffer);
 }
 
 void msgpack_buffer_mark(msgpack_buffer_t* b)
@@ -143,6 +534,7 @@ void msgpack_buffer_clear(msgpack_buffer_t* b)
     while(_msgpack_buffer_shift_chunk(b)) {
         ;
     }
+    b->frame_filled = 0;
 }
 
 size_t msgpack_buffer_read_to_string_nonblock(msgpack_buffer_t* b, VALUE string, size_t length)
@@ -217,6 +609,32 @@ size_t msgpack_buffer_read_nonblock(msgpack_buffer_t* b, char* buffer, size_t le
     }
 }
 
+size_t msgpack_buffer_peek_nonblock(const msgpack_buffer_t* b, char* buffer, size_t length)
+{
+    size_t const length_orig = length;
+    const msgpack_buffer_chunk_t* c = b->head;
+    const char* p = b->read_buffer;
+
+    while(true) {
+        size_t avail = c->last - p;
+
+        if(length <= avail) {
+            memcpy(buffer, p, length);
+            return length_orig;
+        }
+
+        memcpy(buffer, p, avail);
+        buffer += avail;
+        length -= avail;
+
+        if(c == &b->tail) {
+            return length_orig - length;
+        }
+        c = c->next;
+        p = c->first;
+    }
+}
+
 size_t msgpack_buffer_all_readable_size(const msgpack_buffer_t* b)
 {
     size_t sz = msgpack_buffer_top_readable_size(b);
@@ -297,6 +715,50 @@ static inline void _msgpack_buffer_add_new_chunk(msgpack_buffer_t* b)
     }
 }
 
+static inline char* _msgpack_buffer_frame_buffer(msgpack_buffer_t* b)
+{
+    if(b->frame_buffer == NULL) {
+        b->frame_buffer = (char*)malloc(MSGPACK_BUFFER_FRAME_HEADER_SIZE +
+                FRAME_COMPRESSED_LENGTH_MAX);
+        if(b->frame_buffer == NULL) {
+            rb_memerror();
+        }
+    }
+    return b->frame_buffer;
+}
+
+static size_t _msgpack_buffer_write_frame(msgpack_buffer_t* b, VALUE io, ID write_method,
+        const msgpack_buffer_source_t& source)
+{
+    /* source.Available() <= MSGPACK_BUFFER_FRAME_BLOCK_SIZE */
+    char* frame = _msgpack_buffer_frame_buffer(b);
+
+    size_t compressed_length = _msgpack_buffer_write_envelope(b, source,
+            frame + MSGPACK_BUFFER_FRAME_HEADER_SIZE);
+
+    uint32_t be = _msgpack_be32((uint32_t) compressed_length);
+    memcpy(frame, &be, MSGPACK_BUFFER_FRAME_HEADER_SIZE);
+
+    size_t frame_length = MSGPACK_BUFFER_FRAME_HEADER_SIZE + compressed_length;
+    rb_funcall(io, write_method, 1, rb_str_new(frame, frame_length));
+
+    return frame_length;
+}
+
+static size_t _msgpack_buffer_write_frames(msgpack_buffer_t* b, VALUE io, ID write_method,
+        const char* data, size_t length)
+{
+    size_t sz = 0;
+    while(length > 0) {
+        size_t n = length < MSGPACK_BUFFER_FRAME_BLOCK_SIZE ? length : MSGPACK_BUFFER_FRAME_BLOCK_SIZE;
+        msgpack_buffer_source_t source(data, n);
+        sz += _msgpack_buffer_write_frame(b, io, write_method, source);
+        data += n;
+        length -= n;
+    }
+    return sz;
+}
+
 static inline void _msgpack_buffer_append_reference(msgpack_buffer_t* b, VALUE string)
 {
     VALUE mapped_string = rb_str_dup(string);
@@ -323,11 +785,32 @@ static inline void _msgpack_buffer_append_reference(msgpack_buffer_t* b, VALUE s
     }
 }
 
+void msgpack_buffer_refer_frozen_string(msgpack_buffer_t* b, VALUE string, size_t offset, size_t end)
+{
+    /* the string is frozen: refer it as is instead of rb_str_dup */
+    char* data = RSTRING_PTR(string);
+
+    b->tail.first = data;
+    b->tail.last = data + end;
+    b->tail.mapped_string = string;
+    b->tail.mem = NULL;
+    b->tail_buffer_end = b->tail.last;
+
+    /* _msgpack_buffer_refer_head_mapped_string expects the chunk to
+     * start at the head of the string */
+    b->read_buffer = data + offset;
+}
+
 void _msgpack_buffer_append_long_string(msgpack_buffer_t* b, VALUE string)
 {
     size_t length = RSTRING_LEN(string);
 
-    if(b->io != Qnil) {
+    if(b->io != Qnil && b->framed) {
+        msgpack_buffer_flush(b);
+        _msgpack_buffer_write_frames(b, b->io, b->io_write_all_method,
+                RSTRING_PTR(string), length);
+
+    } else if(b->io != Qnil) {
         msgpack_buffer_flush(b);
         rb_funcall(b->io, b->io_write_all_method, 1, string);
 
@@ -409,6 +892,12 @@ static inline void* _msgpack_buffer_chunk_realloc(
 
 void _msgpack_buffer_expand(msgpack_buffer_t* b, const char* data, size_t length, bool flush_to_io)
 {
+    /* framed io compresses whole blocks; keep buffering until one is filled */
+    if(flush_to_io && b->io != Qnil && b->framed &&
+            msgpack_buffer_all_readable_size(b) < MSGPACK_BUFFER_FRAME_BLOCK_SIZE) {
+        flush_to_io = false;
+    }
+
     if(flush_to_io && b->io != Qnil) {
         msgpack_buffer_flush(b);
         if(msgpack_buffer_writable_size(b) >= length) {
@@ -518,51 +1007,29 @@ static inline VALUE _msgpack_buffer_chunk_as_string(msgpack_buffer_chunk_t* c)
     return rb_str_new(c->first, chunk_size);
 }
 
-static VALUE
-_msgpack_buffer_snappify_string(VALUE src)
-{
-    VALUE  dst;
-    size_t  output_length;
-
-    output_length = snappy::MaxCompressedLength(RSTRING_LEN(src));
-
-    dst = rb_str_new(NULL, output_length);
-
-    snappy::RawCompress(RSTRING_PTR(src), RSTRING_LEN(src), RSTRING_PTR(dst), &output_length);
-    rb_str_resize(dst, output_length);
-
-    return dst;
-}
-
 VALUE msgpack_buffer_all_as_string(msgpack_buffer_t* b)
 {
-    if(b->head == &b->tail) {
-        return _msgpack_buffer_snappify_string(_msgpack_buffer_head_chunk_as_string(b));
-    }
-
     size_t length = msgpack_buffer_all_readable_size(b);
-    VALUE string = rb_str_new(NULL, length);
-    char* buffer = RSTRING_PTR(string);
-
-    size_t avail = msgpack_buffer_top_readable_size(b);
-    memcpy(buffer, b->read_buffer, avail);
-    buffer += avail;
-    length -= avail;
-
-    msgpack_buffer_chunk_t* c = b->head->next;
-
-    while(true) {
-        avail = c->last - c->first;
-        memcpy(buffer, c->first, avail);
-
-        if(length <= avail) {
-            return _msgpack_buffer_snappify_string(string);
+    size_t capacity = _msgpack_buffer_envelope_capacity(b, length);
+    msgpack_buffer_source_t source(b, length);
+
+    /* small data is encoded into per-thread scratch memory and copied
+     * into a string of the exact size, which is often embedded */
+    if(capacity <= MSGPACK_BUFFER_SCRATCH_THRESHOLD) {
+        char* scratch = msgpack_codec_scratch(capacity);
+        if(scratch != NULL) {
+            size_t encoded_length = _msgpack_buffer_write_envelope(b, source, scratch);
+            return rb_str_new(scratch, encoded_length);
         }
-        buffer += avail;
-        length -= avail;
-
-        c = c->next;
     }
+
+    VALUE string = rb_str_new(NULL, capacity);
+    msgpack_buffer_envelope_args_t args = { b, &source, RSTRING_PTR(string), 0 };
+    _msgpack_buffer_call_without_gvl(b, _msgpack_buffer_write_envelope_func, &args, length);
+    size_t encoded_length = args.result;
+
+    rb_str_resize(string, encoded_length);
+    return string;
 }
 
 VALUE msgpack_buffer_all_as_string_array(msgpack_buffer_t* b)
@@ -594,12 +1061,48 @@ VALUE msgpack_buffer_all_as_string_array(msgpack_buffer_t* b)
     return ary;
 }
 
+static size_t _msgpack_buffer_flush_frames_to_io(msgpack_buffer_t* b, VALUE io, ID write_method, bool consume)
+{
+    size_t sz = 0;
+
+    if(consume) {
+        size_t length = msgpack_buffer_all_readable_size(b);
+        while(length > 0) {
+            size_t n = length < MSGPACK_BUFFER_FRAME_BLOCK_SIZE ? length : MSGPACK_BUFFER_FRAME_BLOCK_SIZE;
+            msgpack_buffer_source_t source(b, n);
+            sz += _msgpack_buffer_write_frame(b, io, write_method, source);
+            msgpack_buffer_skip_nonblock(b, n);
+            length -= n;
+        }
+        return sz;
+
+    } else {
+        sz += _msgpack_buffer_write_frames(b, io, write_method,
+                b->read_buffer, msgpack_buffer_top_readable_size(b));
+        if(b->head == &b->tail) {
+            return sz;
+        }
+        msgpack_buffer_chunk_t* c = b->head->next;
+        while(true) {
+            sz += _msgpack_buffer_write_frames(b, io, write_method, c->first, c->last - c->first);
+            if(c == &b->tail) {
+                return sz;
+            }
+            c = c->next;
+        }
+    }
+}
+
 size_t msgpack_buffer_flush_to_io(msgpack_buffer_t* b, VALUE io, ID write_method, bool consume)
 {
     if(msgpack_buffer_top_readable_size(b) == 0) {
         return 0;
     }
 
+    if(b->framed) {
+        return _msgpack_buffer_flush_frames_to_io(b, io, write_method, consume);
+    }
+
     VALUE s = _msgpack_buffer_head_chunk_as_string(b);
     rb_funcall(io, write_method, 1, s);
     size_t sz = RSTRING_LEN(s);
@@ -629,7 +1132,314 @@ size_t msgpack_buffer_flush_to_io(msgpack_buffer_t* b, VALUE io, ID write_method
     }
 }
 
-size_t _msgpack_buffer_feed_from_io(msgpack_buffer_t* b)
+
+static inline size_t _msgpack_buffer_frame_length(const char* header)
+{
+    uint32_t be;
+    memcpy(&be, header, MSGPACK_BUFFER_FRAME_HEADER_SIZE);
+    size_t length = _msgpack_be32(be);
+    if(length == 0 || length > FRAME_COMPRESSED_LENGTH_MAX) {
+        rb_raise(rb_ePacksnap, "invalid frame length %lu", (unsigned long) length);
+    }
+    return length;
+}
+
+static inline char* _msgpack_buffer_reserve_nonblock(msgpack_buffer_t* b, size_t length)
+{
+    if(msgpack_buffer_writable_size(b) < length) {
+        _msgpack_buffer_expand(b, NULL, length, false);
+    }
+    return b->tail.last;
+}
+
+static size_t _msgpack_buffer_append_snappy(msgpack_buffer_t* b, const char* data, size_t length, size_t max_length)
+{
+    size_t n;
+    if(!snappy::GetUncompressedLength(data, length, &n) || n > max_length) {
+        rb_raise(rb_ePacksnap, "packsnap::GetUncompressedLength");
+    }
+    if(n == 0) {
+        return 0;
+    }
+
+    /* decompress straight into the tail chunk */
+    char* dst = _msgpack_buffer_reserve_nonblock(b, n);
+    if(!_msgpack_buffer_decompress(b, msgpack_codec_get(MSGPACK_CODEC_SNAPPY), NULL, data, length, dst, n)) {
+        rb_raise(rb_ePacksnap, "packsnap::RawUncompress");
+    }
+    b->tail.last += n;
+
+    return n;
+}
+
+struct msgpack_buffer_compressed_block_t {
+    const msgpack_codec_t* codec;  /* NULL if stored */
+    const msgpack_codec_dictionary_t* dict;
+    const char* src;
+    size_t src_length;
+    char* dst;
+    size_t length;
+    bool ok;
+};
+
+static void _msgpack_buffer_decompress_block(void* data, size_t index)
+{
+    msgpack_buffer_compressed_block_t* block = &((msgpack_buffer_compressed_block_t*) data)[index];
+    if(block->codec == NULL) {
+        memcpy(block->dst, block->src, block->length);
+        block->ok = true;
+    } else {
+        block->ok = block->codec->decompress(block->src, block->src_length,
+                block->dst, block->length, block->dict);
+    }
+}
+
+struct msgpack_buffer_decompress_blocks_args_t {
+    msgpack_buffer_compressed_block_t* blocks;
+    size_t count;
+};
+
+static void* _msgpack_buffer_decompress_blocks_func(void* data)
+{
+    msgpack_buffer_decompress_blocks_args_t* args = (msgpack_buffer_decompress_blocks_args_t*) data;
+    msgpack_pool_run(_msgpack_buffer_decompress_block, args->blocks, args->count);
+    return NULL;
+}
+
+struct msgpack_buffer_append_blocks_args_t {
+    msgpack_buffer_t* b;
+    const char* p;
+    const char* end;
+    size_t n;
+    const msgpack_codec_dictionary_t* dict;
+    size_t block_size;
+    msgpack_buffer_compressed_block_t* blocks;
+    size_t count;
+};
+
+static VALUE _msgpack_buffer_append_blocks_do(VALUE data)
+{
+    msgpack_buffer_append_blocks_args_t* args = (msgpack_buffer_append_blocks_args_t*) data;
+    msgpack_buffer_compressed_block_t* blocks = args->blocks;
+    size_t count = args->count;
+    const char* p = args->p;
+    const char* end = args->end;
+
+    /* read the directory */
+    size_t total = 0;
+    for(size_t i = 0; i < count; i++) {
+        msgpack_buffer_compressed_block_t* block = &blocks[i];
+        int codec = p < end ? (unsigned char) *p++ : MSGPACK_CODEC_MAX;
+        if(codec >= MSGPACK_CODEC_MAX ||
+                (p = _msgpack_buffer_read_varint(p, end, &block->src_length)) == NULL) {
+            return Qfalse;
+        }
+        block->codec = msgpack_codec_get(codec);
+        block->dict = args->dict;
+        if(block->codec == NULL && codec != MSGPACK_CODEC_NONE) {
+            rb_raise(rb_ePacksnap, "codec %d is not supported by this build", codec);
+        }
+        block->length = i < count - 1 ? args->block_size : args->n - i * args->block_size;
+        if((block->codec == NULL && block->src_length != block->length) ||
+                (block->codec != NULL && args->dict != NULL && !block->codec->supports_dictionary)) {
+            return Qfalse;
+        }
+        total += block->src_length;
+    }
+    if(total != (size_t) (end - p)) {
+        return Qfalse;
+    }
+
+    /* decompress straight into the tail chunk */
+    char* dst = _msgpack_buffer_reserve_nonblock(args->b, args->n);
+    for(size_t i = 0; i < count; i++) {
+        blocks[i].src = p;
+        blocks[i].dst = dst + i * args->block_size;
+        p += blocks[i].src_length;
+    }
+
+    msgpack_buffer_decompress_blocks_args_t dargs = { blocks, count };
+    _msgpack_buffer_call_without_gvl(args->b, _msgpack_buffer_decompress_blocks_func, &dargs, args->n);
+
+    for(size_t i = 0; i < count; i++) {
+        if(!blocks[i].ok) {
+            return Qfalse;
+        }
+    }
+    return Qtrue;
+}
+
+static VALUE _msgpack_buffer_append_blocks_free(VALUE data)
+{
+    xfree(((msgpack_buffer_append_blocks_args_t*) data)->blocks);
+    return Qnil;
+}
+
+static bool _msgpack_buffer_append_blocks(msgpack_buffer_t* b, const char* p, const char* end,
+        size_t n, const msgpack_codec_dictionary_t* dict, size_t* result)
+{
+    size_t block_size;
+    p = _msgpack_buffer_read_varint(p, end, &block_size);
+    if(p == NULL || block_size == 0) {
+        return false;
+    }
+
+    size_t count = n / block_size + (n % block_size != 0 ? 1 : 0);
+    if(count > (size_t) (end - p) / 2) {
+        /* each directory entry takes 2 bytes at least */
+        return false;
+    }
+
+    /* the directory is freed even if reading it, reserving the chunk or
+     * decompressing raises */
+    msgpack_buffer_append_blocks_args_t args = { b, p, end, n, dict, block_size,
+        ALLOC_N(msgpack_buffer_compressed_block_t, count), count };
+    VALUE ok = rb_ensure(_msgpack_buffer_append_blocks_do, (VALUE) &args,
+            _msgpack_buffer_append_blocks_free, (VALUE) &args);
+    if(ok != Qtrue) {
+        return false;
+    }
+    b->tail.last += n;
+
+    *result = n;
+    return true;
+}
+
+static bool _msgpack_buffer_append_envelope(msgpack_buffer_t* b, const char* data, size_t length,
+        size_t max_length, size_t* result)
+{
+    const char* end = data + length;
+    if(length < 4 ||
+            (unsigned char) data[0] != MSGPACK_ENVELOPE_MAGIC ||
+            (unsigned char) data[1] != (0x80 | MSGPACK_ENVELOPE_VERSION)) {
+        return false;
+    }
+    int codec = (unsigned char) data[2] & ENVELOPE_CODEC_MASK;
+    int flags = (unsigned char) data[2] & ~ENVELOPE_CODEC_MASK;
+    if(flags & ~ENVELOPE_FLAGS_MASK) {
+        return false;
+    }
+
+    size_t n;
+    const char* p = _msgpack_buffer_read_varint(data + 3, end, &n);
+    if(p == NULL || n > max_length) {
+        return false;
+    }
+
+    const msgpack_codec_dictionary_t* dict = NULL;
+    if(flags & MSGPACK_ENVELOPE_FLAG_DICTIONARY) {
+        size_t id;
+        p = _msgpack_buffer_read_varint(p, end, &id);
+        if(p == NULL) {
+            return false;
+        }
+        dict = msgpack_codec_get_dictionary(id);
+        if(dict == NULL && (codec != MSGPACK_CODEC_NONE || (flags & MSGPACK_ENVELOPE_FLAG_BLOCKS))) {
+            rb_raise(rb_ePacksnap, "dictionary %lu is not registered", (unsigned long) id);
+        }
+    }
+
+    if(flags & MSGPACK_ENVELOPE_FLAG_BLOCKS) {
+        return _msgpack_buffer_append_blocks(b, p, end, n, dict, result);
+    }
+
+    if(codec == MSGPACK_CODEC_NONE) {
+        if((size_t) (end - p) != n) {
+            return false;
+        }
+        msgpack_buffer_append_nonblock(b, p, n);
+        *result = n;
+        return true;
+    }
+
+    if(codec >= MSGPACK_CODEC_MAX) {
+        return false;
+    }
+    const msgpack_codec_t* c = msgpack_codec_get(codec);
+    if(c == NULL) {
+        rb_raise(rb_ePacksnap, "codec %d is not supported by this build", codec);
+    }
+
+    if(n == 0) {
+        *result = 0;
+        return true;
+    }
+
+    /* decompress straight into the tail chunk */
+    char* dst = _msgpack_buffer_reserve_nonblock(b, n);
+    if(dict != NULL && !c->supports_dictionary) {
+        return false;
+    }
+    if(!_msgpack_buffer_decompress(b, c, dict, p, end - p, dst, n)) {
+        return false;
+    }
+    b->tail.last += n;
+
+    *result = n;
+    return true;
+}
+
+size_t msgpack_buffer_append_compressed(msgpack_buffer_t* b, const char* data, size_t length, size_t max_length)
+{
+    size_t n;
+    if(_msgpack_buffer_append_envelope(b, data, length, max_length, &n)) {
+        return n;
+    }
+    /* plain snappy without envelope */
+    return _msgpack_buffer_append_snappy(b, data, length, max_length);
+}
+
+size_t msgpack_buffer_feed_frames(msgpack_buffer_t* b, const char* data, size_t length)
+{
+    char* frame = _msgpack_buffer_frame_buffer(b);
+    size_t decoded = 0;
+
+    while(length > 0) {
+        if(b->frame_filled < MSGPACK_BUFFER_FRAME_HEADER_SIZE) {
+            size_t n = MSGPACK_BUFFER_FRAME_HEADER_SIZE - b->frame_filled;
+            if(length < n) {
+                n = length;
+            }
+            memcpy(frame + b->frame_filled, data, n);
+            b->frame_filled += n;
+            data += n;
+            length -= n;
+            continue;
+        }
+
+        size_t frame_length = _msgpack_buffer_frame_length(frame);
+
+        if(b->frame_filled == MSGPACK_BUFFER_FRAME_HEADER_SIZE && length >= frame_length) {
+            /* whole body is available; decode without copying */
+            decoded += msgpack_buffer_append_compressed(b, data, frame_length,
+                    MSGPACK_BUFFER_FRAME_BLOCK_SIZE);
+            b->frame_filled = 0;
+            data += frame_length;
+            length -= frame_length;
+            continue;
+        }
+
+        size_t n = MSGPACK_BUFFER_FRAME_HEADER_SIZE + frame_length - b->frame_filled;
+        if(length < n) {
+            n = length;
+        }
+        memcpy(frame + b->frame_filled, data, n);
+        b->frame_filled += n;
+        data += n;
+        length -= n;
+
+        if(b->frame_filled == MSGPACK_BUFFER_FRAME_HEADER_SIZE + frame_length) {
+            decoded += msgpack_buffer_append_compressed(b,
+                    frame + MSGPACK_BUFFER_FRAME_HEADER_SIZE, frame_length,
+                    MSGPACK_BUFFER_FRAME_BLOCK_SIZE);
+            b->frame_filled = 0;
+        }
+    }
+
+    return decoded;
+}
+
+static size_t _msgpack_buffer_read_from_io(msgpack_buffer_t* b)
 {
     if(b->io_buffer == Qnil) {
         b->io_buffer = rb_funcall(b->io, b->io_partial_read_method, 1, LONG2FIX(b->io_buffer_size));
@@ -646,14 +1456,37 @@ size_t _msgpack_buffer_feed_from_io(msgpack_buffer_t* b)
         rb_raise(rb_eEOFError, "IO reached end of file");
     }
 
+    return len;
+}
+
+size_t _msgpack_buffer_feed_from_io(msgpack_buffer_t* b)
+{
+    if(b->framed) {
+        /* read until at least one block is decoded */
+        size_t len;
+        do {
+            len = _msgpack_buffer_read_from_io(b);
+            len = msgpack_buffer_feed_frames(b, RSTRING_PTR(b->io_buffer), len);
+        } while(len == 0);
+        return len;
+    }
+
+    size_t len = _msgpack_buffer_read_from_io(b);
+
     /* TODO zero-copy optimize? */
     msgpack_buffer_append_nonblock(b, RSTRING_PTR(b->io_buffer), len);
 
     return len;
 }
 
+
 size_t _msgpack_buffer_read_from_io_to_string(msgpack_buffer_t* b, VALUE string, size_t length)
 {
+    if(b->framed) {
+        _msgpack_buffer_feed_from_io(b);
+        return msgpack_buffer_read_to_string_nonblock(b, string, length);
+    }
+
     if(RSTRING_LEN(string) == 0) {
         /* direct read */
         rb_funcall(b->io, b->io_partial_read_method, 2, LONG2FIX(length), string);
@@ -674,6 +1507,11 @@ size_t _msgpack_buffer_read_from_io_to_string(msgpack_buffer_t* b, VALUE string,
 
 size_t _msgpack_buffer_skip_from_io(msgpack_buffer_t* b, size_t length)
 {
+    if(b->framed) {
+        _msgpack_buffer_feed_from_io(b);
+        return msgpack_buffer_skip_nonblock(b, length);
+    }
+
     if(b->io_buffer == Qnil) {
         b->io_buffer = rb_str_buf_new(0);
     }
@@ -20,6 +20,8 @@
 
 #include "compat.h"
 #include "sysdep.h"
+#include "codec.hh"
+#include "intern.hh"
 
 #ifndef MSGPACK_BUFFER_STRING_WRITE_REFERENCE_DEFAULT
 #define MSGPACK_BUFFER_STRING_WRITE_REFERENCE_DEFAULT (512*1024)
@@ -47,6 +49,44 @@
 #define MSGPACK_BUFFER_IO_BUFFER_SIZE_MINIMUM (1024)
 #endif
 
+/* payloads smaller than this are stored uncompressed */
+#ifndef MSGPACK_BUFFER_COMPRESS_THRESHOLD_DEFAULT
+#define MSGPACK_BUFFER_COMPRESS_THRESHOLD_DEFAULT 64
+#endif
+
+/* smaller data is encoded through per-thread scratch memory */
+#ifndef MSGPACK_BUFFER_SCRATCH_THRESHOLD
+#define MSGPACK_BUFFER_SCRATCH_THRESHOLD (64*1024)
+#endif
+
+/* compression of buffers at least this large releases the GVL */
+#ifndef MSGPACK_BUFFER_NOGVL_THRESHOLD
+#define MSGPACK_BUFFER_NOGVL_THRESHOLD (256*1024)
+#endif
+
+/* payloads at least this large are split into blocks compressed in parallel */
+#ifndef MSGPACK_BUFFER_PARALLEL_THRESHOLD
+#define MSGPACK_BUFFER_PARALLEL_THRESHOLD (4*1024*1024)
+#endif
+
+#ifndef MSGPACK_BUFFER_PARALLEL_BLOCK_SIZE
+#define MSGPACK_BUFFER_PARALLEL_BLOCK_SIZE (1024*1024)
+#endif
+
+#define MSGPACK_ENVELOPE_MAGIC 0xff
+#define MSGPACK_ENVELOPE_VERSION 1
+
+/* flags in the codec byte */
+#define MSGPACK_ENVELOPE_FLAG_DICTIONARY 0x10
+#define MSGPACK_ENVELOPE_FLAG_BLOCKS 0x20
+
+#ifndef MSGPACK_BUFFER_FRAME_BLOCK_SIZE
+#define MSGPACK_BUFFER_FRAME_BLOCK_SIZE (64*1024)
+#endif
+
+/* 4-byte big-endian length of the compressed block */
+#define MSGPACK_BUFFER_FRAME_HEADER_SIZE 4
+
 #define NO_MAPPED_STRING ((VALUE)0)
 
 struct msgpack_buffer_chunk_t;
@@ -106,6 +146,20 @@ struct msgpack_buffer_t {
     size_t write_reference_threshold;
     size_t read_reference_threshold;
     size_t io_buffer_size;
+    size_t compress_threshold;
+    const msgpack_codec_t* codec;  /* NULL to store payloads uncompressed */
+    int codec_level;
+    const msgpack_codec_dictionary_t* dictionary;
+
+    /* framed: data is exchanged as length-prefixed compressed blocks.
+     * frame_buffer holds one compressed frame; frame_filled is the
+     * size of a partially received frame. */
+    bool framed;
+    char* frame_buffer;
+    size_t frame_filled;
+
+    /* set while a thread fills or reads the buffer without the GVL */
+    bool nogvl;
 
     VALUE owner;
 };
@@ -123,8 +177,22 @@ void msgpack_buffer_destroy(msgpack_buffer_t* b);
 
 void msgpack_buffer_mark(msgpack_buffer_t* b);
 
+/*
+ * Raises ThreadError if another thread is filling or reading _b_ without
+ * the GVL: it may reallocate or free the memory meanwhile.
+ */
+static inline void msgpack_buffer_check_nogvl(msgpack_buffer_t* b)
+{
+    if(b->nogvl) {
+        rb_raise(rb_eThreadError, "buffer is in use by another thread");
+    }
+}
+
 void msgpack_buffer_clear(msgpack_buffer_t* b);
 
+/* restores the settings given by options to their defaults */
+void msgpack_buffer_reset_options(msgpack_buffer_t* b);
+
 static inline void msgpack_buffer_set_write_reference_threshold(msgpack_buffer_t* b, size_t length)
 {
     if(length < MSGPACK_BUFFER_STRING_WRITE_REFERENCE_MINIMUM) {
@@ -149,9 +217,33 @@ static inline void msgpack_buffer_set_io_buffer_size(msgpack_buffer_t* b, size_t
     b->io_buffer_size = length;
 }
 
+static inline void msgpack_buffer_set_compress_threshold(msgpack_buffer_t* b, size_t length)
+{
+    b->compress_threshold = length;
+}
+
+static inline void msgpack_buffer_set_codec(msgpack_buffer_t* b,
+        const msgpack_codec_t* codec, int level)
+{
+    b->codec = codec;
+    b->codec_level = (codec != NULL && level == 0) ? codec->default_level : level;
+}
+
+static inline void msgpack_buffer_set_dictionary(msgpack_buffer_t* b,
+        const msgpack_codec_dictionary_t* dict)
+{
+    b->dictionary = dict;
+}
+
+static inline void msgpack_buffer_set_framed(msgpack_buffer_t* b, bool framed)
+{
+    b->framed = framed;
+}
+
 static inline void msgpack_buffer_reset_io(msgpack_buffer_t* b)
 {
     b->io = Qnil;
+    b->framed = false;
 }
 
 static inline bool msgpack_buffer_has_io(msgpack_buffer_t* b)
@@ -254,6 +346,20 @@ static inline size_t msgpack_buffer_append_string(msgpack_buffer_t* b, VALUE str
     return length;
 }
 
+/*
+ * Makes bytes [offset, end) of _string_ readable without copying them.
+ * The buffer must be empty and _string_ must be frozen.
+ */
+void msgpack_buffer_refer_frozen_string(msgpack_buffer_t* b, VALUE string, size_t offset, size_t end);
+
+
+/*
+ * decompression functions
+ */
+size_t msgpack_buffer_append_compressed(msgpack_buffer_t* b, const char* data, size_t length, size_t max_length);
+
+size_t msgpack_buffer_feed_frames(msgpack_buffer_t* b, const char* data, size_t length);
+
 
 /*
  * IO functions
@@ -323,6 +429,9 @@ static inline int msgpack_buffer_read_1(msgpack_buffer_t* b)
 
 size_t msgpack_buffer_read_nonblock(msgpack_buffer_t* b, char* buffer, size_t length);
 
+/* copies up to _length_ readable bytes into _buffer_ without consuming them */
+size_t msgpack_buffer_peek_nonblock(const msgpack_buffer_t* b, char* buffer, size_t length);
+
 static inline bool msgpack_buffer_ensure_readable(msgpack_buffer_t* b, size_t require)
 {
     if(msgpack_buffer_top_readable_size(b) < require) {
@@ -434,6 +543,24 @@ static inline VALUE msgpack_buffer_read_top_as_string(msgpack_buffer_t* b, size_
     return result;
 }
 
+/* _length_ must be at most MSGPACK_INTERN_LENGTH_MAX */
+static inline VALUE msgpack_buffer_read_top_as_interned_string(msgpack_buffer_t* b, size_t length,
+        msgpack_intern_table_t* table)
+{
+    VALUE result = msgpack_intern_table_string(table, b->read_buffer, length);
+    _msgpack_buffer_consumed(b, length);
+    return result;
+}
+
+/* _length_ must be at most MSGPACK_INTERN_LENGTH_MAX */
+static inline VALUE msgpack_buffer_read_top_as_symbol(msgpack_buffer_t* b, size_t length,
+        msgpack_intern_table_t* table)
+{
+    VALUE result = msgpack_intern_table_symbol(table, b->read_buffer, length);
+    _msgpack_buffer_consumed(b, length);
+    return result;
+}
+
 
 #endif
 
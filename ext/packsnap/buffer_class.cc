@@ -33,7 +33,8 @@ static ID s_append;
     Data_Get_Struct(from, msgpack_buffer_t, name); \
     if(name == NULL) { \
         rb_raise(rb_eArgError, "NULL found for " # name " when shouldn't be."); \
-    }
+    } \
+    msgpack_buffer_check_nogvl(name);
 
 #define CHECK_STRING_TYPE(value) \
     value = rb_check_string_type(value); \
@@ -104,6 +105,46 @@ void MessagePack_Buffer_initialize(msgpack_buffer_t* b, VALUE io, VALUE options)
         if(v != Qnil) {
             msgpack_buffer_set_io_buffer_size(b, NUM2ULONG(v));
         }
+
+        v = rb_hash_aref(options, ID2SYM(rb_intern("compress_threshold")));
+        if(v != Qnil) {
+            msgpack_buffer_set_compress_threshold(b, NUM2ULONG(v));
+        }
+
+        v = rb_hash_aref(options, ID2SYM(rb_intern("codec")));
+        VALUE level = rb_hash_aref(options, ID2SYM(rb_intern("level")));
+        if(v != Qnil || level != Qnil) {
+            const msgpack_codec_t* codec = b->codec;
+            if(v != Qnil) {
+                const char* name = rb_id2name(rb_to_id(v));
+                if(strcmp(name, "none") == 0) {
+                    codec = NULL;
+                } else {
+                    codec = msgpack_codec_get_by_name(name);
+                    if(codec == NULL) {
+                        rb_raise(rb_eArgError, "unsupported codec: %s", name);
+                    }
+                }
+            }
+            msgpack_buffer_set_codec(b, codec, level == Qnil ? 0 : NUM2INT(level));
+        }
+
+        v = rb_hash_aref(options, ID2SYM(rb_intern("dictionary")));
+        if(v != Qnil) {
+            const msgpack_codec_dictionary_t* dict = msgpack_codec_get_dictionary(NUM2ULONG(v));
+            if(dict == NULL) {
+                rb_raise(rb_eArgError, "dictionary %lu is not registered", NUM2ULONG(v));
+            }
+            if(b->codec == NULL || !b->codec->supports_dictionary) {
+                rb_raise(rb_eArgError, "codec %s doesn't support dictionaries",
+                        b->codec == NULL ? "none" : b->codec->name);
+            }
+            msgpack_codec_prepare_dictionary(b->codec, dict, b->codec_level);
+            msgpack_buffer_set_dictionary(b, dict);
+        }
+
+        v = rb_hash_aref(options, ID2SYM(rb_intern("framed")));
+        msgpack_buffer_set_framed(b, RTEST(v));
     }
 }
 
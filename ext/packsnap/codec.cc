@@ -0,0 +1,545 @@
+/*
+ * Packsnap
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#include "codec.hh"
+#include <string.h>
+#include <stdlib.h>
+
+#ifdef HAVE_LZ4_H
+#include <lz4.h>
+#endif
+
+#ifdef HAVE_ZSTD_H
+#include <zstd.h>
+#endif
+
+#ifdef HAVE_ZDICT_H
+#include <zdict.h>
+#endif
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+/*
+ * Per-thread state reused across calls: codec contexts and scratch memory.
+ * Ruby threads and pool workers each have their own, so it's used without
+ * locking with or without the GVL. Without pthreads it isn't available
+ * and every call sets up its own state.
+ */
+struct msgpack_codec_context_t {
+    /* msgpack_codec_scratch */
+    char* scratch;
+    size_t scratch_size;
+    /* contiguous copy of input for codecs that need it */
+    char* input;
+    size_t input_size;
+#ifdef HAVE_LZ4_H
+    void* lz4_state;
+#endif
+#ifdef HAVE_ZSTD_H
+    ZSTD_CCtx* cctx;
+    ZSTD_DCtx* dctx;
+#endif
+};
+
+#ifdef HAVE_PTHREAD_H
+static pthread_key_t s_context_key;
+static pthread_once_t s_context_once = PTHREAD_ONCE_INIT;
+
+static void _msgpack_codec_context_free(void* data)
+{
+    msgpack_codec_context_t* ctx = (msgpack_codec_context_t*) data;
+    free(ctx->scratch);
+    free(ctx->input);
+#ifdef HAVE_LZ4_H
+    free(ctx->lz4_state);
+#endif
+#ifdef HAVE_ZSTD_H
+    ZSTD_freeCCtx(ctx->cctx);
+    ZSTD_freeDCtx(ctx->dctx);
+#endif
+    free(ctx);
+}
+
+static void _msgpack_codec_context_key_create()
+{
+    pthread_key_create(&s_context_key, _msgpack_codec_context_free);
+}
+
+static msgpack_codec_context_t* _msgpack_codec_context()
+{
+    pthread_once(&s_context_once, _msgpack_codec_context_key_create);
+    msgpack_codec_context_t* ctx = (msgpack_codec_context_t*) pthread_getspecific(s_context_key);
+    if(ctx == NULL) {
+        ctx = (msgpack_codec_context_t*) calloc(1, sizeof(msgpack_codec_context_t));
+        pthread_setspecific(s_context_key, ctx);
+    }
+    return ctx;
+}
+#else
+static inline msgpack_codec_context_t* _msgpack_codec_context()
+{
+    return NULL;
+}
+#endif
+
+static char* _msgpack_codec_context_memory(char** mem, size_t* mem_size, size_t size)
+{
+    if(size > MSGPACK_CODEC_SCRATCH_MAX) {
+        return NULL;
+    }
+    if(*mem_size < size) {
+        char* m = (char*) malloc(size);
+        if(m == NULL) {
+            /* keep the smaller memory for smaller requests */
+            return NULL;
+        }
+        free(*mem);
+        *mem = m;
+        *mem_size = size;
+    }
+    return *mem;
+}
+
+char* msgpack_codec_scratch(size_t size)
+{
+    msgpack_codec_context_t* ctx = _msgpack_codec_context();
+    if(ctx == NULL) {
+        return NULL;
+    }
+    return _msgpack_codec_context_memory(&ctx->scratch, &ctx->scratch_size, size);
+}
+
+/*
+ * snappy
+ */
+static size_t snappy_max_compressed_length(size_t length)
+{
+    return snappy::MaxCompressedLength(length);
+}
+
+static size_t snappy_compress(snappy::Source* source, char* dst, int level,
+        const msgpack_codec_dictionary_t* dict)
+{
+    UNUSED(level);
+    UNUSED(dict);
+    snappy::UncheckedByteArraySink sink(dst);
+    return snappy::Compress(source, &sink);
+}
+
+static bool snappy_decompress(const char* src, size_t src_length, char* dst, size_t length,
+        const msgpack_codec_dictionary_t* dict)
+{
+    UNUSED(dict);
+    size_t n;
+    if(!snappy::GetUncompressedLength(src, src_length, &n) || n != length) {
+        return false;
+    }
+    return snappy::RawUncompress(src, src_length, dst);
+}
+
+static const msgpack_codec_t s_snappy_codec = {
+    MSGPACK_CODEC_SNAPPY, "snappy", 0, false,
+    snappy_max_compressed_length,
+    snappy_compress,
+    snappy_decompress,
+};
+
+#ifdef HAVE_LZ4_H
+/*
+ * lz4
+ *
+ * level is the acceleration factor of LZ4_compress_fast.
+ */
+static size_t lz4_max_compressed_length(size_t length)
+{
+    return LZ4_compressBound((int) length);
+}
+
+static size_t lz4_compress(snappy::Source* source, char* dst, int level,
+        const msgpack_codec_dictionary_t* dict)
+{
+    UNUSED(dict);
+    size_t length = source->Available();
+    if(length > LZ4_MAX_INPUT_SIZE) {
+        return 0;
+    }
+
+    msgpack_codec_context_t* ctx = _msgpack_codec_context();
+
+    /* the block API needs contiguous input */
+    size_t n;
+    const char* src = source->Peek(&n);
+    char* copy = NULL;
+    if(n < length) {
+        char* buf = ctx == NULL ? NULL :
+            _msgpack_codec_context_memory(&ctx->input, &ctx->input_size, length);
+        if(buf == NULL) {
+            buf = copy = (char*) malloc(length);
+            if(buf == NULL) {
+                /* stored instead */
+                return 0;
+            }
+        }
+        size_t off = 0;
+        while(off < length) {
+            src = source->Peek(&n);
+            memcpy(buf + off, src, n);
+            source->Skip(n);
+            off += n;
+        }
+        src = buf;
+    }
+
+    int ret;
+    if(ctx != NULL && ctx->lz4_state == NULL) {
+        ctx->lz4_state = malloc(LZ4_sizeofState());
+    }
+    if(ctx != NULL && ctx->lz4_state != NULL) {
+        ret = LZ4_compress_fast_extState(ctx->lz4_state, src, dst, (int) length,
+                LZ4_compressBound((int) length), level);
+    } else {
+        ret = LZ4_compress_fast(src, dst, (int) length,
+                LZ4_compressBound((int) length), level);
+    }
+    free(copy);
+
+    return ret > 0 ? (size_t) ret : 0;
+}
+
+static bool lz4_decompress(const char* src, size_t src_length, char* dst, size_t length,
+        const msgpack_codec_dictionary_t* dict)
+{
+    UNUSED(dict);
+    if(src_length > LZ4_MAX_INPUT_SIZE || length > LZ4_MAX_INPUT_SIZE) {
+        return false;
+    }
+    int ret = LZ4_decompress_safe(src, dst, (int) src_length, (int) length);
+    return ret >= 0 && (size_t) ret == length;
+}
+
+static const msgpack_codec_t s_lz4_codec = {
+    MSGPACK_CODEC_LZ4, "lz4", 1, false,
+    lz4_max_compressed_length,
+    lz4_compress,
+    lz4_decompress,
+};
+#endif
+
+#ifdef HAVE_ZSTD_H
+/*
+ * zstd
+ */
+static size_t zstd_max_compressed_length(size_t length)
+{
+    return ZSTD_compressBound(length);
+}
+
+/* contexts come from the thread's context and are reset for each use */
+static ZSTD_CCtx* zstd_cctx_acquire()
+{
+    msgpack_codec_context_t* ctx = _msgpack_codec_context();
+    if(ctx == NULL) {
+        return ZSTD_createCCtx();
+    }
+    if(ctx->cctx == NULL) {
+        ctx->cctx = ZSTD_createCCtx();
+    } else {
+        ZSTD_CCtx_reset(ctx->cctx, ZSTD_reset_session_and_parameters);
+    }
+    return ctx->cctx;
+}
+
+static void zstd_cctx_release(ZSTD_CCtx* cctx)
+{
+    msgpack_codec_context_t* ctx = _msgpack_codec_context();
+    if(ctx == NULL) {
+        ZSTD_freeCCtx(cctx);
+    }
+}
+
+static ZSTD_DCtx* zstd_dctx_acquire()
+{
+    msgpack_codec_context_t* ctx = _msgpack_codec_context();
+    if(ctx == NULL) {
+        return ZSTD_createDCtx();
+    }
+    if(ctx->dctx == NULL) {
+        ctx->dctx = ZSTD_createDCtx();
+    }
+    return ctx->dctx;
+}
+
+static void zstd_dctx_release(ZSTD_DCtx* dctx)
+{
+    msgpack_codec_context_t* ctx = _msgpack_codec_context();
+    if(ctx == NULL) {
+        ZSTD_freeDCtx(dctx);
+    }
+}
+
+/*
+ * Digested dictionaries are added while other threads may compress with
+ * the same dictionary without the GVL. They're published only once they
+ * are complete; readers see either NULL or the whole digest.
+ */
+#ifdef __ATOMIC_ACQUIRE
+#define ZSTD_DIGEST_LOAD(slot) __atomic_load_n(&(slot), __ATOMIC_ACQUIRE)
+#define ZSTD_DIGEST_STORE(slot, digest) __atomic_store_n(&(slot), (void*) (digest), __ATOMIC_RELEASE)
+#else
+#define ZSTD_DIGEST_LOAD(slot) (__sync_synchronize(), (slot))
+#define ZSTD_DIGEST_STORE(slot, digest) (__sync_synchronize(), (slot) = (void*) (digest))
+#endif
+
+static inline ZSTD_CDict* zstd_cdict(const msgpack_codec_dictionary_t* dict, int level)
+{
+    if(level <= 0 || level >= MSGPACK_CODEC_DICTIONARY_LEVELS) {
+        return NULL;
+    }
+    return (ZSTD_CDict*) ZSTD_DIGEST_LOAD(dict->cdicts[level]);
+}
+
+/* called with the GVL, which keeps two threads from digesting at once */
+static void zstd_prepare_dictionary(msgpack_codec_dictionary_t* dict, int level)
+{
+    if(ZSTD_DIGEST_LOAD(dict->ddict) == NULL) {
+        ZSTD_DIGEST_STORE(dict->ddict, ZSTD_createDDict(dict->data, dict->length));
+    }
+    if(level > 0 && level < MSGPACK_CODEC_DICTIONARY_LEVELS && zstd_cdict(dict, level) == NULL) {
+        ZSTD_DIGEST_STORE(dict->cdicts[level], ZSTD_createCDict(dict->data, dict->length, level));
+    }
+}
+
+static size_t zstd_compress(snappy::Source* source, char* dst, int level,
+        const msgpack_codec_dictionary_t* dict)
+{
+    size_t length = source->Available();
+
+    ZSTD_CCtx* cctx = zstd_cctx_acquire();
+    if(cctx == NULL) {
+        return 0;
+    }
+    ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, level);
+    ZSTD_CCtx_setPledgedSrcSize(cctx, length);
+    if(dict != NULL) {
+        ZSTD_CDict* cdict = zstd_cdict(dict, level);
+        if(cdict != NULL) {
+            ZSTD_CCtx_refCDict(cctx, cdict);
+        } else {
+            ZSTD_CCtx_loadDictionary(cctx, dict->data, dict->length);
+        }
+    }
+
+    /* stream the chunks in without concatenating them */
+    ZSTD_outBuffer out = { dst, ZSTD_compressBound(length), 0 };
+    size_t ret = 0;
+    while(source->Available() > 0) {
+        size_t n;
+        const char* src = source->Peek(&n);
+        ZSTD_inBuffer in = { src, n, 0 };
+        while(in.pos < in.size) {
+            ret = ZSTD_compressStream2(cctx, &out, &in, ZSTD_e_continue);
+            if(ZSTD_isError(ret)) {
+                zstd_cctx_release(cctx);
+                return 0;
+            }
+        }
+        source->Skip(n);
+    }
+
+    ZSTD_inBuffer in = { NULL, 0, 0 };
+    do {
+        ret = ZSTD_compressStream2(cctx, &out, &in, ZSTD_e_end);
+        if(ZSTD_isError(ret)) {
+            zstd_cctx_release(cctx);
+            return 0;
+        }
+    } while(ret != 0);
+
+    zstd_cctx_release(cctx);
+    return out.pos;
+}
+
+static bool zstd_decompress(const char* src, size_t src_length, char* dst, size_t length,
+        const msgpack_codec_dictionary_t* dict)
+{
+    unsigned long long n = ZSTD_getFrameContentSize(src, src_length);
+    if(n != length) {
+        return false;
+    }
+
+    ZSTD_DCtx* dctx = zstd_dctx_acquire();
+    if(dctx == NULL) {
+        return false;
+    }
+
+    size_t ret;
+    const ZSTD_DDict* ddict = dict != NULL ? (const ZSTD_DDict*) ZSTD_DIGEST_LOAD(dict->ddict) : NULL;
+    if(ddict != NULL) {
+        ret = ZSTD_decompress_usingDDict(dctx, dst, length, src, src_length, ddict);
+    } else if(dict != NULL) {
+        ret = ZSTD_decompress_usingDict(dctx, dst, length, src, src_length,
+                dict->data, dict->length);
+    } else {
+        ret = ZSTD_decompressDCtx(dctx, dst, length, src, src_length);
+    }
+    zstd_dctx_release(dctx);
+
+    return !ZSTD_isError(ret) && ret == length;
+}
+
+static const msgpack_codec_t s_zstd_codec = {
+    MSGPACK_CODEC_ZSTD, "zstd", 3, true,
+    zstd_max_compressed_length,
+    zstd_compress,
+    zstd_decompress,
+};
+#endif
+
+static const msgpack_codec_t* const s_codecs[MSGPACK_CODEC_MAX] = {
+    NULL,  /* MSGPACK_CODEC_NONE */
+    &s_snappy_codec,
+#ifdef HAVE_LZ4_H
+    &s_lz4_codec,
+#else
+    NULL,
+#endif
+#ifdef HAVE_ZSTD_H
+    &s_zstd_codec,
+#else
+    NULL,
+#endif
+};
+
+const msgpack_codec_t* msgpack_codec_get(int id)
+{
+    if(id < 0 || id >= MSGPACK_CODEC_MAX) {
+        return NULL;
+    }
+    return s_codecs[id];
+}
+
+const msgpack_codec_t* msgpack_codec_get_by_name(const char* name)
+{
+    for(int i = 0; i < MSGPACK_CODEC_MAX; i++) {
+        if(s_codecs[i] != NULL && strcmp(s_codecs[i]->name, name) == 0) {
+            return s_codecs[i];
+        }
+    }
+    return NULL;
+}
+
+size_t msgpack_codec_max_compressed_length(size_t length)
+{
+    size_t max = length;
+    for(int i = 0; i < MSGPACK_CODEC_MAX; i++) {
+        if(s_codecs[i] != NULL) {
+            size_t n = s_codecs[i]->max_compressed_length(length);
+            if(n > max) {
+                max = n;
+            }
+        }
+    }
+    return max;
+}
+
+
+/*
+ * dictionaries
+ */
+static msgpack_codec_dictionary_t* s_dictionaries = NULL;
+
+const msgpack_codec_dictionary_t* msgpack_codec_register_dictionary(unsigned long id,
+        const char* data, size_t length)
+{
+    const msgpack_codec_dictionary_t* d = msgpack_codec_get_dictionary(id);
+    if(d != NULL) {
+        /* registering the same dictionary again is fine */
+        if(d->length == length && memcmp(d->data, data, length) == 0) {
+            return d;
+        }
+        return NULL;
+    }
+
+    msgpack_codec_dictionary_t* dict = (msgpack_codec_dictionary_t*) calloc(1, sizeof(msgpack_codec_dictionary_t));
+    if(dict == NULL) {
+        rb_memerror();
+    }
+    dict->data = (char*) malloc(length > 0 ? length : 1);
+    if(dict->data == NULL) {
+        free(dict);
+        rb_memerror();
+    }
+    dict->id = id;
+    memcpy(dict->data, data, length);
+    dict->length = length;
+
+#ifdef HAVE_ZSTD_H
+    zstd_prepare_dictionary(dict, 0);
+#endif
+
+    dict->next = s_dictionaries;
+    s_dictionaries = dict;
+    return dict;
+}
+
+const msgpack_codec_dictionary_t* msgpack_codec_get_dictionary(unsigned long id)
+{
+    for(msgpack_codec_dictionary_t* d = s_dictionaries; d != NULL; d = d->next) {
+        if(d->id == id) {
+            return d;
+        }
+    }
+    return NULL;
+}
+
+void msgpack_codec_prepare_dictionary(const msgpack_codec_t* codec,
+        const msgpack_codec_dictionary_t* dict, int level)
+{
+#ifdef HAVE_ZSTD_H
+    if(codec->id == MSGPACK_CODEC_ZSTD) {
+        zstd_prepare_dictionary((msgpack_codec_dictionary_t*) dict, level);
+    }
+#else
+    UNUSED(codec);
+    UNUSED(dict);
+    UNUSED(level);
+#endif
+}
+
+size_t msgpack_codec_train_dictionary(char* dict, size_t capacity,
+        const char* samples, const size_t* sizes, unsigned int count,
+        const char** error)
+{
+#if defined(HAVE_ZSTD_H) && defined(HAVE_ZDICT_H)
+    size_t ret = ZDICT_trainFromBuffer(dict, capacity, samples, sizes, count);
+    if(ZDICT_isError(ret)) {
+        *error = ZDICT_getErrorName(ret);
+        return 0;
+    }
+    return ret;
+#else
+    UNUSED(dict);
+    UNUSED(capacity);
+    UNUSED(samples);
+    UNUSED(sizes);
+    UNUSED(count);
+    *error = "dictionary training requires zstd";
+    return 0;
+#endif
+}
+
@@ -0,0 +1,122 @@
+/*
+ * Packsnap
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+#ifndef MSGPACK_RUBY_CODEC_H__
+#define MSGPACK_RUBY_CODEC_H__
+
+#include "compat.h"
+#include "sysdep.h"
+#include "snappy.h"
+
+/* codec ids recorded in the envelope; never reuse a number */
+#define MSGPACK_CODEC_NONE 0
+#define MSGPACK_CODEC_SNAPPY 1
+#define MSGPACK_CODEC_LZ4 2
+#define MSGPACK_CODEC_ZSTD 3
+
+#define MSGPACK_CODEC_MAX 4
+
+/* per-thread scratch memory is kept up to this size */
+#ifndef MSGPACK_CODEC_SCRATCH_MAX
+#define MSGPACK_CODEC_SCRATCH_MAX (2*1024*1024)
+#endif
+
+/* digested dictionaries are cached for levels up to this */
+#define MSGPACK_CODEC_DICTIONARY_LEVELS 23
+
+struct msgpack_codec_t;
+typedef struct msgpack_codec_t msgpack_codec_t;
+
+struct msgpack_codec_dictionary_t;
+typedef struct msgpack_codec_dictionary_t msgpack_codec_dictionary_t;
+
+struct msgpack_codec_t {
+    int id;
+    const char* name;
+    int default_level;
+    bool supports_dictionary;
+
+    size_t (*max_compressed_length)(size_t length);
+
+    /*
+     * Compresses everything available in _source_ into _dst_, which has
+     * max_compressed_length(source->Available()) bytes.
+     * _dict_ is NULL unless supports_dictionary.
+     * Returns the compressed size or 0 on failure.
+     */
+    size_t (*compress)(snappy::Source* source, char* dst, int level,
+            const msgpack_codec_dictionary_t* dict);
+
+    /*
+     * Decompresses _src_ into _dst_ of exactly _length_ bytes.
+     * Returns false if the input is corrupt or has another size.
+     */
+    bool (*decompress)(const char* src, size_t src_length, char* dst, size_t length,
+            const msgpack_codec_dictionary_t* dict);
+};
+
+/*
+ * Dictionaries are registered once per id and live until exit.
+ * The id is recorded in the envelope of data compressed with it.
+ */
+struct msgpack_codec_dictionary_t {
+    unsigned long id;
+    char* data;
+    size_t length;
+
+    /* forms digested by the codec */
+    void* ddict;
+    void* cdicts[MSGPACK_CODEC_DICTIONARY_LEVELS];
+
+    msgpack_codec_dictionary_t* next;
+};
+
+/* NULL if the codec is unknown or not compiled in */
+const msgpack_codec_t* msgpack_codec_get(int id);
+
+const msgpack_codec_t* msgpack_codec_get_by_name(const char* name);
+
+/* largest max_compressed_length of compiled codecs */
+size_t msgpack_codec_max_compressed_length(size_t length);
+
+/*
+ * Returns memory of at least _size_ bytes owned by the calling thread,
+ * valid until the next call on the thread, or NULL if _size_ is larger
+ * than MSGPACK_CODEC_SCRATCH_MAX or per-thread memory isn't supported.
+ */
+char* msgpack_codec_scratch(size_t size);
+
+/* NULL if _id_ is taken by another dictionary */
+const msgpack_codec_dictionary_t* msgpack_codec_register_dictionary(unsigned long id,
+        const char* data, size_t length);
+
+/* NULL if not registered */
+const msgpack_codec_dictionary_t* msgpack_codec_get_dictionary(unsigned long id);
+
+/* digests _dict_ for compression at _level_ ahead of time. Needs the GVL */
+void msgpack_codec_prepare_dictionary(const msgpack_codec_t* codec,
+        const msgpack_codec_dictionary_t* dict, int level);
+
+/*
+ * Trains a dictionary of at most _capacity_ bytes from _count_ samples
+ * concatenated in _samples_. Returns the size of the dictionary, or 0
+ * and sets _error_ on failure.
+ */
+size_t msgpack_codec_train_dictionary(char* dict, size_t capacity,
+        const char* samples, const size_t* sizes, unsigned int count,
+        const char** error);
+
+#endif
+
@@ -103,6 +103,19 @@ extern VALUE s_enc_utf8_value;
 #endif
 
 
+/* older MRI */
+#ifndef HAVE_RB_ARY_CAT
+static inline VALUE rb_ary_cat(VALUE ary, const VALUE* values, long length)
+{
+    long i;
+    for(i = 0; i < length; i++) {
+        rb_ary_push(ary, values[i]);
+    }
+    return ary;
+}
+#endif
+
+
 /* MRI 1.8.5 */
 #ifndef RSTRING_PTR
 #define RSTRING_PTR(s) (RSTRING(s)->ptr)
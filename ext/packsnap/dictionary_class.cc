@@ -0,0 +1,112 @@
+/*
+ * Packsnap
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#include "packsnap.h"
+#include "compat.h"
+#include "ruby.h"
+#include "packer.h"
+#include "packer_class.hh"
+#include "dictionary_class.hh"
+
+#ifndef MSGPACK_DICTIONARY_SIZE_DEFAULT
+#define MSGPACK_DICTIONARY_SIZE_DEFAULT (16*1024)
+#endif
+
+/*
+ * Packsnap.train_dictionary(samples, size = 16384) -> String
+ *
+ * samples are serialized with MessagePack (without compression) and the
+ * dictionary is trained on the serialized bytes.
+ */
+static VALUE MessagePack_train_dictionary(int argc, VALUE* argv, VALUE mod)
+{
+    UNUSED(mod);
+
+    VALUE samples;
+    size_t capacity = MSGPACK_DICTIONARY_SIZE_DEFAULT;
+
+    switch(argc) {
+    case 2:
+        capacity = NUM2ULONG(argv[1]);
+        /* pass-through */
+    case 1:
+        samples = rb_convert_type(argv[0], T_ARRAY, "Array", "to_ary");
+        break;
+    default:
+        rb_raise(rb_eArgError, "wrong number of arguments (%d for 1..2)", argc);
+    }
+
+    long count = RARRAY_LEN(samples);
+    if(count == 0) {
+        rb_raise(rb_eArgError, "no samples given");
+    }
+
+    VALUE packer = rb_class_new_instance(0, NULL, cMessagePack_Packer);
+    msgpack_packer_t* pk;
+    Data_Get_Struct(packer, msgpack_packer_t, pk);
+    msgpack_buffer_t* b = PACKER_BUFFER_(pk);
+
+    /* serialize samples back to back into the buffer of the packer. sizes
+     * live in a String, which isn't leaked if a sample can't be packed */
+    VALUE sizes = rb_str_new(NULL, count * sizeof(size_t));
+    size_t total = 0;
+    for(long i = 0; i < count; i++) {
+        msgpack_packer_write_value(pk, rb_ary_entry(samples, i));
+        size_t n = msgpack_buffer_all_readable_size(b);
+        ((size_t*) RSTRING_PTR(sizes))[i] = n - total;
+        total = n;
+    }
+    VALUE data = rb_str_new(NULL, total);
+    msgpack_buffer_read_all(b, RSTRING_PTR(data), total);
+
+    VALUE dict = rb_str_new(NULL, capacity);
+    const char* error = NULL;
+    size_t length = msgpack_codec_train_dictionary(RSTRING_PTR(dict), capacity,
+            RSTRING_PTR(data), (const size_t*) RSTRING_PTR(sizes), (unsigned int) count, &error);
+    RB_GC_GUARD(packer);
+    RB_GC_GUARD(sizes);
+    RB_GC_GUARD(data);
+
+    if(length == 0) {
+        rb_raise(rb_ePacksnap, "failed to train dictionary: %s", error);
+    }
+    rb_str_resize(dict, length);
+    return dict;
+}
+
+/*
+ * Packsnap.register_dictionary(id, dictionary) -> id
+ */
+static VALUE MessagePack_register_dictionary(VALUE mod, VALUE id, VALUE dict)
+{
+    UNUSED(mod);
+
+    unsigned long n = NUM2ULONG(id);
+    StringValue(dict);
+
+    if(msgpack_codec_register_dictionary(n, RSTRING_PTR(dict), RSTRING_LEN(dict)) == NULL) {
+        rb_raise(rb_eArgError, "dictionary %lu is already registered", n);
+    }
+    return id;
+}
+
+extern "C"
+void MessagePack_Dictionary_module_init(VALUE mMessagePack)
+{
+    rb_define_module_function(mMessagePack, "train_dictionary", (VALUE (*)(...))MessagePack_train_dictionary, -1);
+    rb_define_module_function(mMessagePack, "register_dictionary", (VALUE (*)(...))MessagePack_register_dictionary, 2);
+}
+
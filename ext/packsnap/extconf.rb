@@ -89,6 +89,28 @@ snappy.h
   FileUtils.touch 'config.h'
 end
 
+# worker pool for parallel block compression
+have_header('pthread.h')
+have_header('unistd.h')
+
+have_header('ruby/thread.h') and have_func('rb_thread_call_without_gvl', 'ruby/thread.h')
+
+# symbolize_keys makes GC-able symbols when available
+have_func('rb_sym2str')
+
+# numeric runs in arrays are appended in batches
+have_func('rb_ary_cat')
+
+# scan fixint runs 32 bytes at a time; SSE2 is used otherwise on x86-64
+$CFLAGS << ' -mavx2' if enable_config('avx2', false)
+
+# optional codecs; HAVE_LZ4_H and HAVE_ZSTD_H enable them in codec.cc
+have_library('lz4', 'LZ4_compress_fast', 'lz4.h') and have_header('lz4.h')
+if have_library('zstd', 'ZSTD_compressStream2', 'zstd.h') and have_header('zstd.h')
+  # dictionary training
+  have_header('zdict.h')
+end
+
 have_library 'stdc++'
 create_makefile('packsnap/packsnap')
 
@@ -0,0 +1,55 @@
+/*
+ * Packsnap
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#include "intern.hh"
+
+msgpack_intern_table_t* msgpack_intern_table_new()
+{
+    /* zero is Qfalse: an empty slot */
+    return (msgpack_intern_table_t*) calloc(1, sizeof(msgpack_intern_table_t));
+}
+
+void msgpack_intern_table_free(msgpack_intern_table_t* t)
+{
+    free(t);
+}
+
+void msgpack_intern_table_mark(msgpack_intern_table_t* t)
+{
+    msgpack_intern_entry_t* e = t->entries;
+    msgpack_intern_entry_t* const eend = t->entries + MSGPACK_INTERN_CAPACITY;
+    for(; e < eend; e++) {
+        if(e->value != 0) {
+            rb_gc_mark(e->value);
+        }
+    }
+}
+
+VALUE _msgpack_intern_symbol_new(const char* data, size_t length)
+{
+#ifdef HAVE_RB_SYM2STR
+    /* don't create an immortal symbol for each key of untrusted data:
+     * refer an existing one or make a dynamic one which GC can collect */
+    ID id = rb_check_id_cstr(data, length, rb_ascii8bit_encoding());
+    if(id != 0) {
+        return ID2SYM(id);
+    }
+    return rb_str_intern(rb_str_new(data, length));
+#else
+    return ID2SYM(rb_intern2(data, length));
+#endif
+}
+
@@ -0,0 +1,131 @@
+/*
+ * Packsnap
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+#ifndef MSGPACK_RUBY_INTERN_H__
+#define MSGPACK_RUBY_INTERN_H__
+
+#include "compat.h"
+#include "sysdep.h"
+
+#ifndef HAVE_RB_SYM2STR
+#define rb_sym2str(sym) rb_id2str(SYM2ID(sym))
+#endif
+
+/*
+ * Bounded table of frozen strings or symbols keyed by their bytes.
+ * It's direct-mapped: a string replaces the one in its slot on collision,
+ * so memory stays fixed however many distinct strings are looked up.
+ */
+
+/* number of slots; must be a power of 2 */
+#ifndef MSGPACK_INTERN_CAPACITY
+#define MSGPACK_INTERN_CAPACITY 1024
+#endif
+
+/* longer strings are never interned */
+#ifndef MSGPACK_INTERN_LENGTH_MAX
+#define MSGPACK_INTERN_LENGTH_MAX 64
+#endif
+
+struct msgpack_intern_table_t;
+typedef struct msgpack_intern_table_t msgpack_intern_table_t;
+
+typedef struct {
+    uint32_t hash;
+    VALUE value;
+} msgpack_intern_entry_t;
+
+struct msgpack_intern_table_t {
+    msgpack_intern_entry_t entries[MSGPACK_INTERN_CAPACITY];
+};
+
+msgpack_intern_table_t* msgpack_intern_table_new();
+
+void msgpack_intern_table_free(msgpack_intern_table_t* t);
+
+void msgpack_intern_table_mark(msgpack_intern_table_t* t);
+
+static inline uint32_t msgpack_intern_hash(const char* data, size_t length)
+{
+    /* FNV-1a */
+    uint32_t h = 2166136261U;
+    const unsigned char* p = (const unsigned char*) data;
+    const unsigned char* const pend = p + length;
+    for(; p < pend; p++) {
+        h = (h ^ *p) * 16777619U;
+    }
+    return h;
+}
+
+static inline bool _msgpack_intern_string_equals(VALUE string, const char* data, size_t length)
+{
+    return (size_t) RSTRING_LEN(string) == length &&
+        memcmp(RSTRING_PTR(string), data, length) == 0;
+}
+
+static inline msgpack_intern_entry_t* _msgpack_intern_table_slot(msgpack_intern_table_t* t, uint32_t hash)
+{
+    return &t->entries[hash & (MSGPACK_INTERN_CAPACITY - 1)];
+}
+
+/*
+ * Returns a frozen string with the _length_ bytes at _data_, which is
+ * the same object as an earlier call returned while it stays in the table.
+ * _length_ must be at most MSGPACK_INTERN_LENGTH_MAX.
+ */
+static inline VALUE msgpack_intern_table_string(msgpack_intern_table_t* t,
+        const char* data, size_t length)
+{
+    uint32_t hash = msgpack_intern_hash(data, length);
+    msgpack_intern_entry_t* e = _msgpack_intern_table_slot(t, hash);
+
+    if(e->hash == hash && e->value != 0 &&
+            _msgpack_intern_string_equals(e->value, data, length)) {
+        return e->value;
+    }
+
+    VALUE string = rb_str_new(data, length);
+    rb_obj_freeze(string);
+    e->hash = hash;
+    e->value = string;
+    return string;
+}
+
+VALUE _msgpack_intern_symbol_new(const char* data, size_t length);
+
+/*
+ * Returns the Symbol named by the _length_ bytes at _data_. A table
+ * holds either strings or symbols, never both.
+ * _length_ must be at most MSGPACK_INTERN_LENGTH_MAX.
+ */
+static inline VALUE msgpack_intern_table_symbol(msgpack_intern_table_t* t,
+        const char* data, size_t length)
+{
+    uint32_t hash = msgpack_intern_hash(data, length);
+    msgpack_intern_entry_t* e = _msgpack_intern_table_slot(t, hash);
+
+    if(e->hash == hash && e->value != 0 &&
+            _msgpack_intern_string_equals(rb_sym2str(e->value), data, length)) {
+        return e->value;
+    }
+
+    VALUE symbol = _msgpack_intern_symbol_new(data, length);
+    e->hash = hash;
+    e->value = symbol;
+    return symbol;
+}
+
+#endif
+
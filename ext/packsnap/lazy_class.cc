@@ -0,0 +1,520 @@
+/*
+ * Packsnap
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#include "packsnap.h"
+#include "unpacker.hh"
+#include "unpacker_class.hh"
+#include "lazy_class.hh"
+
+VALUE cMessagePack_LazyMap;
+VALUE cMessagePack_LazyArray;
+
+/*
+ * A view over the children of a map or an array serialized in _source_.
+ * Children are located on first access, by jumping along the tape of
+ * _source_ if it has one or with msgpack_unpacker_skip, and decoded one
+ * by one when they're accessed. A map has a key and a value as children
+ * for each entry.
+ */
+struct msgpack_lazy_t;
+typedef struct msgpack_lazy_t msgpack_lazy_t;
+
+struct msgpack_lazy_t {
+    VALUE source;    /* frozen String */
+    size_t offset;   /* of the first child */
+    size_t end;      /* of the last child */
+    size_t count;
+
+    /* wrapped msgpack_unpacker_tape_t of source, or Qnil */
+    VALUE tape;
+    size_t entry;    /* of the first child on the tape */
+
+    /* count+1 boundaries of children; valid if indexed */
+    size_t* offsets;
+    bool indexed;
+
+    /* tape entries of children; valid if indexed with a tape */
+    size_t* entries;
+
+    /* decoded children or Qundef; NULL until a child is decoded */
+    VALUE* children;
+
+    /* NULL until a child is skipped or decoded */
+    msgpack_unpacker_t* cursor;
+    size_t depth_max;  /* of the cursor */
+};
+
+#define LAZY(from, name) \
+    msgpack_lazy_t *name = NULL; \
+    Data_Get_Struct(from, msgpack_lazy_t, name); \
+    if(name == NULL) { \
+        rb_raise(rb_eArgError, "NULL found for " # name " when shouldn't be."); \
+    }
+
+static void Lazy_free(msgpack_lazy_t* l)
+{
+    if(l == NULL) {
+        return;
+    }
+    if(l->cursor != NULL) {
+        msgpack_unpacker_destroy(l->cursor);
+        free(l->cursor);
+    }
+    free(l->offsets);
+    free(l->entries);
+    free(l->children);
+    free(l);
+}
+
+static void Lazy_mark(msgpack_lazy_t* l)
+{
+    rb_gc_mark(l->source);
+    rb_gc_mark(l->tape);
+
+    if(l->children != NULL) {
+        for(size_t i = 0; i < l->count; i++) {
+            rb_gc_mark(l->children[i]);
+        }
+    }
+
+    if(l->cursor != NULL) {
+        msgpack_unpacker_mark(l->cursor);
+    }
+}
+
+static VALUE Lazy_wrap(VALUE klass, VALUE source, size_t offset, size_t end, size_t count,
+        VALUE tape, size_t entry, size_t depth_max)
+{
+    msgpack_lazy_t* l = ALLOC_N(msgpack_lazy_t, 1);
+    memset(l, 0, sizeof(msgpack_lazy_t));
+    l->source = source;
+    l->offset = offset;
+    l->end = end;
+    l->count = count;
+    l->tape = tape;
+    l->entry = entry;
+    l->depth_max = depth_max;
+
+    return Data_Wrap_Struct(klass, Lazy_mark, Lazy_free, l);
+}
+
+/* returns the cursor positioned to read bytes [offset, end) of source */
+static msgpack_unpacker_t* Lazy_cursor(msgpack_lazy_t* l, size_t offset, size_t end)
+{
+    if(l->cursor == NULL) {
+        msgpack_unpacker_t* uk = ALLOC_N(msgpack_unpacker_t, 1);
+        msgpack_unpacker_init(uk);
+        msgpack_unpacker_set_max_depth(uk, l->depth_max);
+        l->cursor = uk;
+    }
+
+    msgpack_unpacker_reset(l->cursor);
+    msgpack_buffer_refer_frozen_string(UNPACKER_BUFFER_(l->cursor), l->source, offset, end);
+    return l->cursor;
+}
+
+static inline size_t Lazy_cursor_position(msgpack_lazy_t* l, size_t end)
+{
+    return end - msgpack_buffer_all_readable_size(UNPACKER_BUFFER_(l->cursor));
+}
+
+static inline size_t Lazy_read_be(const char* p, size_t n)
+{
+    const unsigned char* q = (const unsigned char*) p;
+    size_t v = 0;
+    for(size_t i = 0; i < n; i++) {
+        v = (v << 8) | q[i];
+    }
+    return v;
+}
+
+/*
+ * Returns the size of the header if a map or an array starts at _p_,
+ * or 0 for other types.
+ */
+static size_t Lazy_container_header(const char* p, const char* pend, bool* is_map, size_t* count)
+{
+    unsigned int b = (unsigned char) *p;
+
+    if(0x90 <= b && b <= 0x9f) {
+        *is_map = false;
+        *count = b & 0x0f;
+        return 1;
+    }
+    if(0x80 <= b && b <= 0x8f) {
+        *is_map = true;
+        *count = b & 0x0f;
+        return 1;
+    }
+
+    size_t n;
+    switch(b) {
+    case 0xdc:  // array 16
+    case 0xde:  // map 16
+        n = 2;
+        break;
+    case 0xdd:  // array 32
+    case 0xdf:  // map 32
+        n = 4;
+        break;
+    default:
+        return 0;
+    }
+
+    if((size_t)(pend - p) < 1 + n) {
+        MessagePack_Unpacker_raise_error(PRIMITIVE_EOF);
+    }
+    *is_map = (b == 0xde || b == 0xdf);
+    *count = Lazy_read_be(p + 1, n);
+    return 1 + n;
+}
+
+/*
+ * Returns true and the size of the header and the body if a raw starts
+ * at _p_. The raw is known to be complete.
+ */
+static bool Lazy_raw_header(const char* p, size_t* header, size_t* length)
+{
+    unsigned int b = (unsigned char) *p;
+
+    if(0xa0 <= b && b <= 0xbf) {
+        *header = 1;
+        *length = b & 0x1f;
+        return true;
+    }
+    if(b == 0xda) {
+        *header = 3;
+        *length = Lazy_read_be(p + 1, 2);
+        return true;
+    }
+    if(b == 0xdb) {
+        *header = 5;
+        *length = Lazy_read_be(p + 1, 4);
+        return true;
+    }
+    return false;
+}
+
+static void Lazy_tape_free(msgpack_unpacker_tape_t* tape)
+{
+    msgpack_unpacker_tape_destroy(tape);
+    free(tape);
+}
+
+static VALUE Lazy_tape_new(VALUE source, size_t depth_max)
+{
+    msgpack_unpacker_tape_t* tape = ALLOC_N(msgpack_unpacker_tape_t, 1);
+    memset(tape, 0, sizeof(msgpack_unpacker_tape_t));
+    /* hidden object; freed with the last view */
+    VALUE self = Data_Wrap_Struct(0, NULL, Lazy_tape_free, tape);
+
+    int r = msgpack_unpacker_build_tape(RSTRING_PTR(source), RSTRING_LEN(source), depth_max, tape);
+    if(r < 0) {
+        MessagePack_Unpacker_raise_error(r);
+    }
+    return self;
+}
+
+static void Lazy_index_tape(msgpack_lazy_t* l)
+{
+    msgpack_unpacker_tape_t* tape;
+    Data_Get_Struct(l->tape, msgpack_unpacker_tape_t, tape);
+
+    l->entries = (size_t*) malloc(sizeof(size_t) * (l->count + 1));
+    if(l->entries == NULL) {
+        rb_memerror();
+    }
+
+    /* the first child follows the container; the others are its siblings */
+    size_t e = l->entry;
+    for(size_t i = 0; i < l->count; i++) {
+        l->entries[i] = e;
+        l->offsets[i] = tape->entries[e].offset;
+        e = tape->entries[e].next;
+    }
+    l->entries[l->count] = e;
+    l->offsets[l->count] = l->end;
+}
+
+static void Lazy_index(msgpack_lazy_t* l)
+{
+    if(l->indexed) {
+        return;
+    }
+
+    /* every child takes a byte at least: don't trust the count of
+     * broken data to allocate offsets */
+    if(l->count > l->end - l->offset) {
+        MessagePack_Unpacker_raise_error(PRIMITIVE_EOF);
+    }
+
+    if(l->offsets == NULL) {
+        l->offsets = (size_t*) malloc(sizeof(size_t) * (l->count + 1));
+        if(l->offsets == NULL) {
+            rb_memerror();
+        }
+    }
+
+    if(l->tape != Qnil) {
+        Lazy_index_tape(l);
+        l->indexed = true;
+        return;
+    }
+
+    msgpack_unpacker_t* uk = Lazy_cursor(l, l->offset, l->end);
+    for(size_t i = 0; i < l->count; i++) {
+        l->offsets[i] = Lazy_cursor_position(l, l->end);
+        int r = msgpack_unpacker_skip(uk, 0);
+        if(r < 0) {
+            MessagePack_Unpacker_raise_error(r);
+        }
+    }
+    l->offsets[l->count] = Lazy_cursor_position(l, l->end);
+
+    l->indexed = true;
+}
+
+/*
+ * Maps and arrays become views; other objects are decoded. _entry_ is the
+ * tape entry of the object if there's a tape.
+ */
+static VALUE Lazy_decode(msgpack_lazy_t* l, size_t offset, size_t end, size_t entry)
+{
+    const char* p = RSTRING_PTR(l->source);
+
+    bool is_map;
+    size_t count;
+    size_t header = Lazy_container_header(p + offset, p + end, &is_map, &count);
+    if(header > 0) {
+        if(is_map) {
+            return Lazy_wrap(cMessagePack_LazyMap, l->source, offset + header, end, count * 2,
+                    l->tape, entry + 1, l->depth_max);
+        }
+        return Lazy_wrap(cMessagePack_LazyArray, l->source, offset + header, end, count,
+                l->tape, entry + 1, l->depth_max);
+    }
+
+    msgpack_unpacker_t* uk = Lazy_cursor(l, offset, end);
+    int r = msgpack_unpacker_read(uk, 0);
+    if(r < 0) {
+        MessagePack_Unpacker_raise_error(r);
+    }
+    return msgpack_unpacker_get_last_object(uk);
+}
+
+static VALUE Lazy_child(msgpack_lazy_t* l, size_t i)
+{
+    Lazy_index(l);
+
+    if(l->children == NULL) {
+        VALUE* children = (VALUE*) malloc(sizeof(VALUE) * l->count);
+        if(children == NULL) {
+            rb_memerror();
+        }
+        for(size_t j = 0; j < l->count; j++) {
+            children[j] = Qundef;
+        }
+        l->children = children;
+    }
+
+    if(l->children[i] == Qundef) {
+        size_t entry = l->entries != NULL ? l->entries[i] : 0;
+        l->children[i] = Lazy_decode(l, l->offsets[i], l->offsets[i+1], entry);
+    }
+    return l->children[i];
+}
+
+VALUE MessagePack_Lazy_new(VALUE source, bool tape, size_t depth_max)
+{
+    size_t length = RSTRING_LEN(source);
+    if(length == 0) {
+        MessagePack_Unpacker_raise_error(PRIMITIVE_EOF);
+    }
+
+    VALUE t = Qnil;
+    if(tape) {
+        t = Lazy_tape_new(source, depth_max);
+    }
+
+    /* decode the head of source as the only child of a view */
+    VALUE root = Lazy_wrap(cMessagePack_LazyArray, source, 0, length, 1, t, 0, depth_max);
+    LAZY(root, l);
+
+    /* nothing may follow the object. without a tape, this skips it once;
+     * a tape isn't built for data with extra bytes */
+    Lazy_index(l);
+    if(l->offsets[1] != length) {
+        MessagePack_Unpacker_raise_error(PRIMITIVE_EXTRA_BYTES);
+    }
+
+    VALUE object = Lazy_decode(l, 0, length, 0);
+    RB_GC_GUARD(root);
+    return object;
+}
+
+static VALUE LazyArray_size(VALUE self)
+{
+    LAZY(self, l);
+    return ULONG2NUM((unsigned long) l->count);
+}
+
+static VALUE LazyArray_aref(VALUE self, VALUE index)
+{
+    LAZY(self, l);
+
+    long i = NUM2LONG(index);
+    if(i < 0) {
+        i += (long) l->count;
+    }
+    if(i < 0 || (size_t) i >= l->count) {
+        return Qnil;
+    }
+
+    return Lazy_child(l, (size_t) i);
+}
+
+static VALUE LazyArray_each(VALUE self)
+{
+    LAZY(self, l);
+
+#ifdef RETURN_ENUMERATOR
+    RETURN_ENUMERATOR(self, 0, 0);
+#endif
+
+    for(size_t i = 0; i < l->count; i++) {
+        rb_yield(Lazy_child(l, i));
+    }
+
+    return self;
+}
+
+static bool LazyMap_key_matches(msgpack_lazy_t* l, size_t i, VALUE key)
+{
+    VALUE name;
+    if(rb_type(key) == T_STRING) {
+        name = key;
+    } else if(SYMBOL_P(key)) {
+        name = rb_sym2str(key);
+    } else {
+        return rb_eql(Lazy_child(l, i), key);
+    }
+
+    /* compare the bytes of a raw key without decoding it */
+    const char* p = RSTRING_PTR(l->source) + l->offsets[i];
+    size_t header;
+    size_t length;
+    if(!Lazy_raw_header(p, &header, &length)) {
+        return false;
+    }
+    return length == (size_t) RSTRING_LEN(name) &&
+        memcmp(p + header, RSTRING_PTR(name), length) == 0;
+}
+
+/* index of the value of _key_, or count if not found */
+static size_t LazyMap_find(msgpack_lazy_t* l, VALUE key)
+{
+    Lazy_index(l);
+
+    /* the last one wins as in a Hash */
+    for(size_t i = l->count; i > 0; i -= 2) {
+        if(LazyMap_key_matches(l, i - 2, key)) {
+            return i - 1;
+        }
+    }
+    return l->count;
+}
+
+static VALUE LazyMap_size(VALUE self)
+{
+    LAZY(self, l);
+    return ULONG2NUM((unsigned long) (l->count / 2));
+}
+
+static VALUE LazyMap_aref(VALUE self, VALUE key)
+{
+    LAZY(self, l);
+
+    size_t i = LazyMap_find(l, key);
+    if(i == l->count) {
+        return Qnil;
+    }
+    return Lazy_child(l, i);
+}
+
+static VALUE LazyMap_has_key(VALUE self, VALUE key)
+{
+    LAZY(self, l);
+
+    if(LazyMap_find(l, key) == l->count) {
+        return Qfalse;
+    }
+    return Qtrue;
+}
+
+static VALUE LazyMap_keys(VALUE self)
+{
+    LAZY(self, l);
+
+    VALUE keys = rb_ary_new2(l->count / 2);
+    for(size_t i = 0; i < l->count; i += 2) {
+        rb_ary_push(keys, Lazy_child(l, i));
+    }
+    return keys;
+}
+
+static VALUE LazyMap_each(VALUE self)
+{
+    LAZY(self, l);
+
+#ifdef RETURN_ENUMERATOR
+    RETURN_ENUMERATOR(self, 0, 0);
+#endif
+
+    for(size_t i = 0; i < l->count; i += 2) {
+        VALUE key = Lazy_child(l, i);
+        rb_yield(rb_assoc_new(key, Lazy_child(l, i + 1)));
+    }
+
+    return self;
+}
+
+extern "C"
+void MessagePack_Lazy_module_init(VALUE mMessagePack)
+{
+    cMessagePack_LazyMap = rb_define_class_under(mMessagePack, "LazyMap", rb_cObject);
+    rb_undef_alloc_func(cMessagePack_LazyMap);
+    rb_include_module(cMessagePack_LazyMap, rb_mEnumerable);
+
+    rb_define_method(cMessagePack_LazyMap, "[]", (VALUE (*)(...))LazyMap_aref, 1);
+    rb_define_method(cMessagePack_LazyMap, "key?", (VALUE (*)(...))LazyMap_has_key, 1);
+    rb_define_alias(cMessagePack_LazyMap, "has_key?", "key?");
+    rb_define_alias(cMessagePack_LazyMap, "include?", "key?");
+    rb_define_method(cMessagePack_LazyMap, "keys", (VALUE (*)(...))LazyMap_keys, 0);
+    rb_define_method(cMessagePack_LazyMap, "size", (VALUE (*)(...))LazyMap_size, 0);
+    rb_define_alias(cMessagePack_LazyMap, "length", "size");
+    rb_define_method(cMessagePack_LazyMap, "each", (VALUE (*)(...))LazyMap_each, 0);
+    rb_define_alias(cMessagePack_LazyMap, "each_pair", "each");
+
+    cMessagePack_LazyArray = rb_define_class_under(mMessagePack, "LazyArray", rb_cObject);
+    rb_undef_alloc_func(cMessagePack_LazyArray);
+    rb_include_module(cMessagePack_LazyArray, rb_mEnumerable);
+
+    rb_define_method(cMessagePack_LazyArray, "[]", (VALUE (*)(...))LazyArray_aref, 1);
+    rb_define_method(cMessagePack_LazyArray, "size", (VALUE (*)(...))LazyArray_size, 0);
+    rb_define_alias(cMessagePack_LazyArray, "length", "size");
+    rb_define_method(cMessagePack_LazyArray, "each", (VALUE (*)(...))LazyArray_each, 0);
+}
+
@@ -0,0 +1,37 @@
+/*
+ * Packsnap
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+#ifndef MSGPACK_RUBY_LAZY_CLASS_H__
+#define MSGPACK_RUBY_LAZY_CLASS_H__
+
+#include "unpacker.hh"
+
+extern VALUE cMessagePack_LazyMap;
+extern VALUE cMessagePack_LazyArray;
+
+extern "C"
+void MessagePack_Lazy_module_init(VALUE mMessagePack);
+
+/*
+ * Returns a LazyMap or LazyArray over the object serialized at the head
+ * of _source_, a frozen String, or the object itself if it's not a map
+ * or an array. With _tape_, _source_ is validated and its structural
+ * tape recorded up front, so that the views find children by jumping
+ * along it instead of skipping over their bytes.
+ */
+VALUE MessagePack_Lazy_new(VALUE source, bool tape, size_t depth_max);
+
+#endif
+
@@ -47,7 +47,8 @@ void msgpack_packer_reset(msgpack_packer_t* pk)
 
     pk->io = Qnil;
     pk->io_write_all_method = 0;
-    pk->buffer_ref = Qnil;
+
+    /* keep buffer_ref: it marks strings mapped by the buffer */
 }
 
 
@@ -28,15 +28,15 @@ VALUE cMessagePack_Packer;
 static ID s_to_msgpack;
 static ID s_write;
 
-//static VALUE s_packer_value;
-//static msgpack_packer_t* s_packer;
+static ID s_packer_key;
 
 #define PACKER(from, name) \
     msgpack_packer_t* name; \
     Data_Get_Struct(from, msgpack_packer_t, name); \
     if(name == NULL) { \
         rb_raise(rb_eArgError, "NULL found for " # name " when shouldn't be."); \
-    }
+    } \
+    msgpack_buffer_check_nogvl(PACKER_BUFFER_(name));
 
 static void Packer_free(msgpack_packer_t* pk)
 {
@@ -193,46 +193,97 @@ static VALUE Packer_write_to(VALUE self, VALUE io)
 //    return self;
 //}
 
+/*
+ * Packsnap.pack uses a packer cached in fiber-local storage and reset
+ * after each call, so that a call allocates only the result string.
+ * It's taken out of the storage while in use: a nested call (e.g. from
+ * a to_msgpack method) allocates its own.
+ */
+static VALUE MessagePack_pack_checkout()
+{
+    VALUE thread = rb_thread_current();
+    VALUE self = rb_thread_local_aref(thread, s_packer_key);
+    if(self != Qnil) {
+        rb_thread_local_aset(thread, s_packer_key, Qnil);
+        return self;
+    }
+    return Packer_alloc(cMessagePack_Packer);
+}
+
+static VALUE MessagePack_pack_checkin(VALUE self)
+{
+    PACKER(self, pk);
+
+    /* free rmem and drop the IO before the next call */
+    msgpack_packer_reset(pk);
+    msgpack_buffer_reset_io(PACKER_BUFFER_(pk));
+    msgpack_buffer_reset_options(PACKER_BUFFER_(pk));
+
+    rb_thread_local_aset(rb_thread_current(), s_packer_key, self);
+    return Qnil;
+}
+
+struct msgpack_pack_args_t {
+    VALUE self;
+    VALUE v;
+    VALUE io;
+    VALUE options;
+};
+
+static VALUE MessagePack_pack_do(VALUE data)
+{
+    msgpack_pack_args_t* args = (msgpack_pack_args_t*) data;
+    PACKER(args->self, pk);
+
+    if(args->io != Qnil || args->options != Qnil) {
+        MessagePack_Buffer_initialize(PACKER_BUFFER_(pk), args->io, args->options);
+    }
+    if(args->io != Qnil) {
+        msgpack_buffer_set_framed(PACKER_BUFFER_(pk), true);
+    }
+
+    msgpack_packer_write_value(pk, args->v);
+
+    if(args->io != Qnil) {
+        msgpack_buffer_flush(PACKER_BUFFER_(pk));
+        return Qnil;
+    }
+    return msgpack_buffer_all_as_string(PACKER_BUFFER_(pk));
+}
+
 extern "C"
 VALUE MessagePack_pack(int argc, VALUE* argv)
 {
-    // TODO options
-
     VALUE v;
     VALUE io = Qnil;
+    VALUE options = Qnil;
 
     switch(argc) {
-    case 2:
+    case 3:
         io = argv[1];
-        /* pass-through */
+        options = argv[2];
+        if(options != Qnil && rb_type(options) != T_HASH) {
+            rb_raise(rb_eArgError, "expected Hash but found %s.", rb_obj_classname(options));
+        }
+        break;
+    case 2:
+        if(rb_type(argv[1]) == T_HASH) {
+            options = argv[1];
+        } else {
+            io = argv[1];
+        }
+        break;
     case 1:
-        v = argv[0];
         break;
     default:
-        rb_raise(rb_eArgError, "wrong number of arguments (%d for 1..2)", argc);
-    }
-
-    VALUE self = Packer_alloc(cMessagePack_Packer);
-    PACKER(self, pk);
-    //msgpack_packer_reset(s_packer);
-    //msgpack_buffer_reset_io(PACKER_BUFFER_(s_packer));
-
-    if(io != Qnil) {
-        MessagePack_Buffer_initialize(PACKER_BUFFER_(pk), io, Qnil);
-    }
-
-    msgpack_packer_write_value(pk, v);
-
-    VALUE retval;
-    if(io != Qnil) {
-        msgpack_buffer_flush(PACKER_BUFFER_(pk));
-        retval = Qnil;
-    } else {
-        retval = msgpack_buffer_all_as_string(PACKER_BUFFER_(pk));
+        rb_raise(rb_eArgError, "wrong number of arguments (%d for 1..3)", argc);
     }
+    v = argv[0];
 
-    msgpack_buffer_clear(PACKER_BUFFER_(pk)); /* to free rmem before GC */
-    return retval;
+    VALUE self = MessagePack_pack_checkout();
+    msgpack_pack_args_t args = { self, v, io, options };
+    return rb_ensure(MessagePack_pack_do, (VALUE) &args,
+            MessagePack_pack_checkin, self);
 }
 
 static VALUE MessagePack_dump_module_method(int argc, VALUE* argv, VALUE mod)
@@ -252,6 +303,7 @@ void MessagePack_Packer_module_init(VALUE mMessagePack)
 {
     s_to_msgpack = rb_intern("to_msgpack");
     s_write = rb_intern("write");
+    s_packer_key = rb_intern("__packsnap_packer__");
 
     cMessagePack_Packer = rb_define_class_under(mMessagePack, "Packer", rb_cObject);
 
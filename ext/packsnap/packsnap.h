@@ -1,4 +1,3 @@
 #include "ruby.h"
-static VALUE rb_mPacksnap;
-static VALUE rb_ePacksnap;
-
+extern VALUE rb_mPacksnap;
+extern VALUE rb_ePacksnap;
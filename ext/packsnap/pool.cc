@@ -0,0 +1,171 @@
+/*
+ * Packsnap
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#include "pool.hh"
+
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_UNISTD_H)
+#include <pthread.h>
+#include <unistd.h>
+
+struct msgpack_pool_job_t;
+typedef struct msgpack_pool_job_t msgpack_pool_job_t;
+
+struct msgpack_pool_job_t {
+    msgpack_pool_task_t func;
+    void* data;
+    size_t count;
+    size_t next;   /* next index to run */
+    size_t done;
+    pthread_cond_t finished;
+    msgpack_pool_job_t* next_job;
+};
+
+/* jobs which still have tasks to start */
+static msgpack_pool_job_t* s_jobs = NULL;
+
+static pthread_mutex_t s_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t s_wakeup = PTHREAD_COND_INITIALIZER;
+static size_t s_threads = 0;
+static bool s_started = false;
+static pthread_once_t s_atfork_once = PTHREAD_ONCE_INIT;
+
+static void _msgpack_pool_remove_job(msgpack_pool_job_t* job)
+{
+    msgpack_pool_job_t** p = &s_jobs;
+    while(*p != job) {
+        p = &(*p)->next_job;
+    }
+    *p = job->next_job;
+}
+
+/* called with s_mutex locked; unlocks it while the task runs */
+static void _msgpack_pool_run_task(msgpack_pool_job_t* job)
+{
+    size_t i = job->next++;
+    if(job->next == job->count) {
+        _msgpack_pool_remove_job(job);
+    }
+
+    pthread_mutex_unlock(&s_mutex);
+    job->func(job->data, i);
+    pthread_mutex_lock(&s_mutex);
+
+    if(++job->done == job->count) {
+        pthread_cond_signal(&job->finished);
+    }
+}
+
+static void* _msgpack_pool_worker(void* arg)
+{
+    UNUSED(arg);
+    pthread_mutex_lock(&s_mutex);
+    while(true) {
+        while(s_jobs == NULL) {
+            pthread_cond_wait(&s_wakeup, &s_mutex);
+        }
+        _msgpack_pool_run_task(s_jobs);
+    }
+    return NULL;
+}
+
+/* workers don't survive fork(2) */
+static void _msgpack_pool_atfork_child()
+{
+    pthread_mutex_init(&s_mutex, NULL);
+    pthread_cond_init(&s_wakeup, NULL);
+    s_jobs = NULL;
+    s_threads = 0;
+    s_started = false;
+}
+
+static void _msgpack_pool_register_atfork()
+{
+    pthread_atfork(NULL, NULL, _msgpack_pool_atfork_child);
+}
+
+/* called with s_mutex locked */
+static void _msgpack_pool_start()
+{
+    s_started = true;
+    pthread_once(&s_atfork_once, _msgpack_pool_register_atfork);
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if(cpus > MSGPACK_POOL_THREADS_MAX) {
+        cpus = MSGPACK_POOL_THREADS_MAX;
+    }
+
+    /* the calling thread works too */
+    for(long i = 1; i < cpus; i++) {
+        pthread_t th;
+        if(pthread_create(&th, NULL, _msgpack_pool_worker, NULL) != 0) {
+            break;
+        }
+        pthread_detach(th);
+        s_threads++;
+    }
+}
+
+void msgpack_pool_run(msgpack_pool_task_t func, void* data, size_t count)
+{
+    if(count == 0) {
+        return;
+    }
+
+    msgpack_pool_job_t job;
+    job.func = func;
+    job.data = data;
+    job.count = count;
+    job.next = 0;
+    job.done = 0;
+    pthread_cond_init(&job.finished, NULL);
+
+    pthread_mutex_lock(&s_mutex);
+    if(!s_started) {
+        _msgpack_pool_start();
+    }
+
+    job.next_job = NULL;
+    msgpack_pool_job_t** p = &s_jobs;
+    while(*p != NULL) {
+        p = &(*p)->next_job;
+    }
+    *p = &job;
+    if(s_threads > 0 && count > 1) {
+        pthread_cond_broadcast(&s_wakeup);
+    }
+
+    while(job.next < job.count) {
+        _msgpack_pool_run_task(&job);
+    }
+    while(job.done < job.count) {
+        pthread_cond_wait(&job.finished, &s_mutex);
+    }
+    pthread_mutex_unlock(&s_mutex);
+
+    pthread_cond_destroy(&job.finished);
+}
+
+#else
+
+void msgpack_pool_run(msgpack_pool_task_t func, void* data, size_t count)
+{
+    for(size_t i = 0; i < count; i++) {
+        func(data, i);
+    }
+}
+
+#endif
+
@@ -0,0 +1,43 @@
+/*
+ * Packsnap
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+#ifndef MSGPACK_RUBY_POOL_H__
+#define MSGPACK_RUBY_POOL_H__
+
+#include "compat.h"
+#include "sysdep.h"
+
+/*
+ * Fixed-size pool of native worker threads.
+ * Workers never touch Ruby objects, so tasks may run without the GVL.
+ */
+
+#ifndef MSGPACK_POOL_THREADS_MAX
+#define MSGPACK_POOL_THREADS_MAX 16
+#endif
+
+typedef void (*msgpack_pool_task_t)(void* data, size_t index);
+
+/*
+ * Calls func(data, i) for each i in [0, count) on the workers and the
+ * calling thread, and returns when all of them are done.
+ * Workers are started on first use, one per CPU up to
+ * MSGPACK_POOL_THREADS_MAX. Without pthreads tasks run in order on the
+ * calling thread.
+ */
+void msgpack_pool_run(msgpack_pool_task_t func, void* data, size_t count);
+
+#endif
+
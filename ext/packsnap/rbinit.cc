@@ -21,6 +21,11 @@
 #include "buffer_class.hh"
 #include "packer_class.hh"
 #include "unpacker_class.hh"
+#include "dictionary_class.hh"
+#include "lazy_class.hh"
+
+VALUE rb_mPacksnap;
+VALUE rb_ePacksnap;
 
 #ifdef COMPAT_HAVE_ENCODING
 /* see compat.h*/
@@ -48,5 +53,7 @@ void Init_packsnap(void)
     MessagePack_Buffer_module_init(mMessagePack);
     MessagePack_Packer_module_init(mMessagePack);
     MessagePack_Unpacker_module_init(mMessagePack);
+    MessagePack_Dictionary_module_init(mMessagePack);
+    MessagePack_Lazy_module_init(mMessagePack);
 }
 
@@ -0,0 +1,95 @@
+/*
+ * Packsnap
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+#ifndef MSGPACK_RUBY_SIMD_H__
+#define MSGPACK_RUBY_SIMD_H__
+
+#include "compat.h"
+#include "sysdep.h"
+
+/*
+ * Vectorized scanning of runs of fixints (0x00-0x7f and 0xe0-0xff).
+ * AVX2 is used when the extension is compiled with it (--enable-avx2),
+ * SSE2 on any other x86-64 build, plain loops elsewhere.
+ */
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define MSGPACK_SIMD_AVX2
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define MSGPACK_SIMD_SSE2
+#endif
+
+/* signed, the fixints are exactly the bytes from -32 to 127 */
+static inline bool msgpack_simd_is_fixint(char b)
+{
+    return (int8_t)b >= -32;
+}
+
+/* returns how many of the first _length_ bytes at _p_ are fixints in a row */
+static inline size_t msgpack_simd_fixint_run(const char* p, size_t length)
+{
+    size_t i = 0;
+
+#if defined(MSGPACK_SIMD_AVX2)
+    const __m256i below = _mm256_set1_epi8(-33);
+    for(; i + 32 <= length; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(p + i));
+        if(_mm256_movemask_epi8(_mm256_cmpgt_epi8(v, below)) != -1) {
+            break;
+        }
+    }
+#elif defined(MSGPACK_SIMD_SSE2)
+    const __m128i below = _mm_set1_epi8(-33);
+    for(; i + 16 <= length; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(p + i));
+        if(_mm_movemask_epi8(_mm_cmpgt_epi8(v, below)) != 0xffff) {
+            break;
+        }
+    }
+#endif
+
+    for(; i < length; i++) {
+        if(!msgpack_simd_is_fixint(p[i])) {
+            break;
+        }
+    }
+    return i;
+}
+
+/* stores the Fixnums for _length_ fixint bytes at _p_ to _values_ */
+static inline void msgpack_simd_fixints_to_values(const char* p, size_t length, VALUE* values)
+{
+    size_t i = 0;
+
+#if defined(MSGPACK_SIMD_AVX2) && SIZEOF_VALUE == 8
+    /* sign extend 4 bytes at a time to (n << 1) | FIXNUM_FLAG */
+    const __m256i flag = _mm256_set1_epi64x(FIXNUM_FLAG);
+    for(; i + 4 <= length; i += 4) {
+        int32_t quad;
+        memcpy(&quad, p + i, 4);
+        __m256i v = _mm256_cvtepi8_epi64(_mm_cvtsi32_si128(quad));
+        v = _mm256_or_si256(_mm256_slli_epi64(v, 1), flag);
+        _mm256_storeu_si256((__m256i*)(values + i), v);
+    }
+#endif
+
+    for(; i < length; i++) {
+        values[i] = INT2FIX((int8_t)p[i]);
+    }
+}
+
+#endif
+
@@ -17,6 +17,7 @@
  */
 
 #include "unpacker.hh"
+#include "simd.h"
 
 #define HEAD_BYTE_REQUIRED 0xc6
 
@@ -30,14 +31,19 @@ void msgpack_unpacker_init(msgpack_unpacker_t* uk)
 
     uk->last_object = Qnil;
     uk->reading_raw = Qnil;
+    uk->read_into_keys = Qnil;
+    uk->read_into_set = Qnil;
 
     uk->stack = (msgpack_unpacker_stack_t*)calloc(MSGPACK_UNPACKER_STACK_CAPACITY, sizeof(msgpack_unpacker_stack_t));
     uk->stack_capacity = MSGPACK_UNPACKER_STACK_CAPACITY;
+    uk->stack_depth_max = MSGPACK_UNPACKER_STACK_DEPTH_MAX_DEFAULT;
 }
 
 void msgpack_unpacker_destroy(msgpack_unpacker_t* uk)
 {
     free(uk->stack);
+    msgpack_intern_table_free(uk->intern);
+    msgpack_intern_table_free(uk->symbols);
     msgpack_buffer_destroy(UNPACKER_BUFFER_(uk));
 }
 
@@ -56,6 +62,15 @@ void msgpack_unpacker_mark(msgpack_unpacker_t* uk)
     /* See MessagePack_Buffer_wrap */
     /* msgpack_buffer_mark(UNPACKER_BUFFER_(uk)); */
     rb_gc_mark(uk->buffer_ref);
+    rb_gc_mark(uk->read_into_keys);
+    rb_gc_mark(uk->read_into_set);
+
+    if(uk->intern != NULL) {
+        msgpack_intern_table_mark(uk->intern);
+    }
+    if(uk->symbols != NULL) {
+        msgpack_intern_table_mark(uk->symbols);
+    }
 }
 
 void msgpack_unpacker_reset(msgpack_unpacker_t* uk)
@@ -64,13 +79,22 @@ void msgpack_unpacker_reset(msgpack_unpacker_t* uk)
 
     uk->head_byte = HEAD_BYTE_REQUIRED;
 
-    memset(uk->stack, 0, sizeof(msgpack_unpacker_t) * uk->stack_depth);
+    memset(uk->stack, 0, sizeof(msgpack_unpacker_stack_t) * uk->stack_depth);
     uk->stack_depth = 0;
 
     uk->last_object = Qnil;
     uk->reading_raw = Qnil;
     uk->reading_raw_remaining = 0;
-    uk->buffer_ref = Qnil;
+
+    /* keep buffer_ref: it marks strings mapped by the buffer */
+    /* keep intern: interned strings are reused by the next read */
+}
+
+void msgpack_unpacker_reset_options(msgpack_unpacker_t* uk)
+{
+    uk->stack_depth_max = MSGPACK_UNPACKER_STACK_DEPTH_MAX_DEFAULT;
+    uk->intern_values = false;
+    uk->symbolize_keys = false;
 }
 
 
@@ -112,13 +136,34 @@ static inline msgpack_unpacker_stack_t* _msgpack_unpacker_stack_top(msgpack_unpa
     return &uk->stack[uk->stack_depth-1];
 }
 
+static void _msgpack_unpacker_stack_expand(msgpack_unpacker_t* uk)
+{
+    size_t capacity = uk->stack_capacity * 2;
+    if(capacity > uk->stack_depth_max) {
+        capacity = uk->stack_depth_max;
+    }
+
+    msgpack_unpacker_stack_t* stack = (msgpack_unpacker_stack_t*)realloc(uk->stack,
+            capacity * sizeof(msgpack_unpacker_stack_t));
+    if(stack == NULL) {
+        rb_memerror();
+    }
+
+    /* entries above stack_depth are never marked: no need to clear */
+    uk->stack = stack;
+    uk->stack_capacity = capacity;
+}
+
 static inline int _msgpack_unpacker_stack_push(msgpack_unpacker_t* uk, enum stack_type_t type, size_t count, VALUE object)
 {
     reset_head_byte(uk);
 
-    if(uk->stack_capacity - uk->stack_depth <= 0) {
+    if(uk->stack_depth >= uk->stack_depth_max) {
         return PRIMITIVE_STACK_TOO_DEEP;
     }
+    if(uk->stack_depth == uk->stack_capacity) {
+        _msgpack_unpacker_stack_expand(uk);
+    }
 
     msgpack_unpacker_stack_t* next = &uk->stack[uk->stack_depth];
     next->count = count;
@@ -141,21 +186,97 @@ static inline bool msgpack_unpacker_stack_is_empty(msgpack_unpacker_t* uk)
     return uk->stack_depth == 0;
 }
 
-#ifdef USE_CASE_RANGE
-
-#define SWITCH_RANGE_BEGIN(BYTE)     { switch(BYTE) {
-#define SWITCH_RANGE(BYTE, FROM, TO) } case FROM ... TO: {
-#define SWITCH_RANGE_DEFAULT         } default: {
-#define SWITCH_RANGE_END             } }
-
-#else
-
-#define SWITCH_RANGE_BEGIN(BYTE)     { if(0) {
-#define SWITCH_RANGE(BYTE, FROM, TO) } else if(FROM <= (BYTE) && (BYTE) <= TO) {
-#define SWITCH_RANGE_DEFAULT         } else {
-#define SWITCH_RANGE_END             } }
-
-#endif
+/*
+ * Every head byte is mapped to one of these kinds through head_byte_kinds
+ * so that read_primitive, skip_primitive and peek dispatch with a single
+ * switch over a dense range, which compilers turn into one indirect jump.
+ */
+enum head_byte_kind_t {
+    HEAD_INVALID = 0,
+    HEAD_POSITIVE_FIXNUM,
+    HEAD_NEGATIVE_FIXNUM,
+    HEAD_FIXRAW,
+    HEAD_FIXARRAY,
+    HEAD_FIXMAP,
+    HEAD_NIL,
+    HEAD_FALSE,
+    HEAD_TRUE,
+    HEAD_FLOAT,
+    HEAD_DOUBLE,
+    HEAD_UINT8,
+    HEAD_UINT16,
+    HEAD_UINT32,
+    HEAD_UINT64,
+    HEAD_INT8,
+    HEAD_INT16,
+    HEAD_INT32,
+    HEAD_INT64,
+    HEAD_RAW16,
+    HEAD_RAW32,
+    HEAD_ARRAY16,
+    HEAD_ARRAY32,
+    HEAD_MAP16,
+    HEAD_MAP32,
+    HEAD_KIND_COUNT,
+};
+
+#define HEAD_BYTE_ROW(k) k, k, k, k, k, k, k, k, k, k, k, k, k, k, k, k
+
+static const uint8_t head_byte_kinds[256] = {
+    /* 0x00 - 0x7f */
+    HEAD_BYTE_ROW(HEAD_POSITIVE_FIXNUM), HEAD_BYTE_ROW(HEAD_POSITIVE_FIXNUM),
+    HEAD_BYTE_ROW(HEAD_POSITIVE_FIXNUM), HEAD_BYTE_ROW(HEAD_POSITIVE_FIXNUM),
+    HEAD_BYTE_ROW(HEAD_POSITIVE_FIXNUM), HEAD_BYTE_ROW(HEAD_POSITIVE_FIXNUM),
+    HEAD_BYTE_ROW(HEAD_POSITIVE_FIXNUM), HEAD_BYTE_ROW(HEAD_POSITIVE_FIXNUM),
+    /* 0x80 - 0x8f */
+    HEAD_BYTE_ROW(HEAD_FIXMAP),
+    /* 0x90 - 0x9f */
+    HEAD_BYTE_ROW(HEAD_FIXARRAY),
+    /* 0xa0 - 0xbf */
+    HEAD_BYTE_ROW(HEAD_FIXRAW), HEAD_BYTE_ROW(HEAD_FIXRAW),
+    /* 0xc0 - 0xcf */
+    HEAD_NIL, HEAD_INVALID, HEAD_FALSE, HEAD_TRUE,
+    HEAD_INVALID, HEAD_INVALID, HEAD_INVALID, HEAD_INVALID,
+    HEAD_INVALID, HEAD_INVALID, HEAD_FLOAT, HEAD_DOUBLE,
+    HEAD_UINT8, HEAD_UINT16, HEAD_UINT32, HEAD_UINT64,
+    /* 0xd0 - 0xdf */
+    HEAD_INT8, HEAD_INT16, HEAD_INT32, HEAD_INT64,
+    HEAD_INVALID, HEAD_INVALID, HEAD_INVALID, HEAD_INVALID,
+    HEAD_INVALID, HEAD_INVALID, HEAD_RAW16, HEAD_RAW32,
+    HEAD_ARRAY16, HEAD_ARRAY32, HEAD_MAP16, HEAD_MAP32,
+    /* 0xe0 - 0xff */
+    HEAD_BYTE_ROW(HEAD_NEGATIVE_FIXNUM), HEAD_BYTE_ROW(HEAD_NEGATIVE_FIXNUM),
+};
+
+#undef HEAD_BYTE_ROW
+
+static const int8_t head_kind_types[HEAD_KIND_COUNT] = {
+    PRIMITIVE_INVALID_BYTE,  /* HEAD_INVALID */
+    TYPE_INTEGER,            /* HEAD_POSITIVE_FIXNUM */
+    TYPE_INTEGER,            /* HEAD_NEGATIVE_FIXNUM */
+    TYPE_RAW,                /* HEAD_FIXRAW */
+    TYPE_ARRAY,              /* HEAD_FIXARRAY */
+    TYPE_MAP,                /* HEAD_FIXMAP */
+    TYPE_NIL,                /* HEAD_NIL */
+    TYPE_BOOLEAN,            /* HEAD_FALSE */
+    TYPE_BOOLEAN,            /* HEAD_TRUE */
+    TYPE_FLOAT,              /* HEAD_FLOAT */
+    TYPE_FLOAT,              /* HEAD_DOUBLE */
+    TYPE_INTEGER,            /* HEAD_UINT8 */
+    TYPE_INTEGER,            /* HEAD_UINT16 */
+    TYPE_INTEGER,            /* HEAD_UINT32 */
+    TYPE_INTEGER,            /* HEAD_UINT64 */
+    TYPE_INTEGER,            /* HEAD_INT8 */
+    TYPE_INTEGER,            /* HEAD_INT16 */
+    TYPE_INTEGER,            /* HEAD_INT32 */
+    TYPE_INTEGER,            /* HEAD_INT64 */
+    TYPE_RAW,                /* HEAD_RAW16 */
+    TYPE_RAW,                /* HEAD_RAW32 */
+    TYPE_ARRAY,              /* HEAD_ARRAY16 */
+    TYPE_ARRAY,              /* HEAD_ARRAY32 */
+    TYPE_MAP,                /* HEAD_MAP16 */
+    TYPE_MAP,                /* HEAD_MAP32 */
+};
 
 
 #define READ_CAST_BLOCK_OR_RETURN_EOF(cb, uk, n) \
@@ -175,6 +296,14 @@ static inline bool is_reading_map_key(msgpack_unpacker_t* uk)
     return false;
 }
 
+static inline msgpack_intern_table_t* get_intern_table(msgpack_intern_table_t** t)
+{
+    if(*t == NULL) {
+        *t = msgpack_intern_table_new();
+    }
+    return *t;
+}
+
 static int read_raw_body_cont(msgpack_unpacker_t* uk)
 {
     size_t length = uk->reading_raw_remaining;
@@ -205,10 +334,21 @@ static inline int read_raw_body_begin(msgpack_unpacker_t* uk)
     /* try optimized read */
     size_t length = uk->reading_raw_remaining;
     if(length <= msgpack_buffer_top_readable_size(UNPACKER_BUFFER_(uk))) {
-        /* don't use zerocopy for hash keys because
-         * rb_hash_aset freezes keys and causes copying */
-        bool suppress_reference = is_reading_map_key(uk);
-        VALUE string = msgpack_buffer_read_top_as_string(UNPACKER_BUFFER_(uk), length, suppress_reference);
+        bool reading_map_key = is_reading_map_key(uk);
+        VALUE string;
+        msgpack_intern_table_t* table;
+        if(length <= MSGPACK_INTERN_LENGTH_MAX && reading_map_key && uk->symbolize_keys &&
+                (table = get_intern_table(&uk->symbols)) != NULL) {
+            string = msgpack_buffer_read_top_as_symbol(UNPACKER_BUFFER_(uk), length, table);
+        } else if(length <= MSGPACK_INTERN_LENGTH_MAX && (reading_map_key || uk->intern_values) &&
+                (table = get_intern_table(&uk->intern)) != NULL) {
+            /* rb_hash_aset stores frozen keys as they are */
+            string = msgpack_buffer_read_top_as_interned_string(UNPACKER_BUFFER_(uk), length, table);
+        } else {
+            /* don't use zerocopy for hash keys because
+             * rb_hash_aset freezes keys and causes copying */
+            string = msgpack_buffer_read_top_as_string(UNPACKER_BUFFER_(uk), length, reading_map_key);
+        }
         object_complete(uk, string);
         uk->reading_raw_remaining = 0;
         return PRIMITIVE_OBJECT_COMPLETE;
@@ -228,211 +368,185 @@ static int read_primitive(msgpack_unpacker_t* uk)
         return b;
     }
 
-    SWITCH_RANGE_BEGIN(b)
-    SWITCH_RANGE(b, 0x00, 0x7f)  // Positive Fixnum
+    switch(head_byte_kinds[b]) {
+    case HEAD_POSITIVE_FIXNUM:
         return object_complete(uk, INT2FIX(b));
 
-    SWITCH_RANGE(b, 0xe0, 0xff)  // Negative Fixnum
+    case HEAD_NEGATIVE_FIXNUM:
         return object_complete(uk, INT2FIX((int8_t)b));
 
-    SWITCH_RANGE(b, 0xa0, 0xbf)  // FixRaw
-        int count = b & 0x1f;
-        if(count == 0) {
-            return object_complete(uk, rb_str_buf_new(0));
+    case HEAD_FIXRAW:
+        {
+            int count = b & 0x1f;
+            if(count == 0) {
+                return object_complete(uk, rb_str_buf_new(0));
+            }
+            uk->reading_raw_remaining = count;
+            return read_raw_body_begin(uk);
         }
-        //uk->reading_raw = rb_str_buf_new(count);
-        uk->reading_raw_remaining = count;
-        return read_raw_body_begin(uk);
 
-    SWITCH_RANGE(b, 0x90, 0x9f)  // FixArray
-        int count = b & 0x0f;
-        if(count == 0) {
-            return object_complete(uk, rb_ary_new());
+    case HEAD_FIXARRAY:
+        {
+            int count = b & 0x0f;
+            if(count == 0) {
+                return object_complete(uk, rb_ary_new());
+            }
+            return _msgpack_unpacker_stack_push(uk, STACK_TYPE_ARRAY, count, rb_ary_new2(count));
         }
-//printf("fix array %d\n", count);
-        return _msgpack_unpacker_stack_push(uk, STACK_TYPE_ARRAY, count, rb_ary_new2(count));
 
-    SWITCH_RANGE(b, 0x80, 0x8f)  // FixMap
-        int count = b & 0x0f;
-        if(count == 0) {
-            return object_complete(uk, rb_hash_new());
+    case HEAD_FIXMAP:
+        {
+            int count = b & 0x0f;
+            if(count == 0) {
+                return object_complete(uk, rb_hash_new());
+            }
+            return _msgpack_unpacker_stack_push(uk, STACK_TYPE_MAP_KEY, count*2, rb_hash_new());
         }
-//printf("fix map %d %x\n", count, b);
-        return _msgpack_unpacker_stack_push(uk, STACK_TYPE_MAP_KEY, count*2, rb_hash_new());
-
-    SWITCH_RANGE(b, 0xc0, 0xdf)  // Variable
-        switch(b) {
-        case 0xc0:  // nil
-            return object_complete(uk, Qnil);
-
-        //case 0xc1:  // string
 
-        case 0xc2:  // false
-            return object_complete(uk, Qfalse);
+    case HEAD_NIL:
+        return object_complete(uk, Qnil);
 
-        case 0xc3:  // true
-            return object_complete(uk, Qtrue);
+    case HEAD_FALSE:
+        return object_complete(uk, Qfalse);
 
-        //case 0xc4:
-        //case 0xc5:
-        //case 0xc6:
-        //case 0xc7:
-        //case 0xc8:
-        //case 0xc9:
+    case HEAD_TRUE:
+        return object_complete(uk, Qtrue);
 
-        case 0xca:  // float
-            {
-                READ_CAST_BLOCK_OR_RETURN_EOF(cb, uk, 4);
-                cb->u32 = _msgpack_be_float(cb->u32);
-                return object_complete(uk, rb_float_new(cb->f));
-            }
-
-        case 0xcb:  // double
-            {
-                READ_CAST_BLOCK_OR_RETURN_EOF(cb, uk, 8);
-                cb->u64 = _msgpack_be_double(cb->u64);
-                return object_complete(uk, rb_float_new(cb->d));
-            }
+    case HEAD_FLOAT:
+        {
+            READ_CAST_BLOCK_OR_RETURN_EOF(cb, uk, 4);
+            cb->u32 = _msgpack_be_float(cb->u32);
+            return object_complete(uk, rb_float_new(cb->f));
+        }
 
-            //int n = 1 << (((unsigned int)*p) & 0x03)
-        case 0xcc:  // unsigned int  8
-            {
-                READ_CAST_BLOCK_OR_RETURN_EOF(cb, uk, 1);
-                uint8_t u8 = cb->u8;
-                return object_complete(uk, INT2FIX((int)u8));
-            }
+    case HEAD_DOUBLE:
+        {
+            READ_CAST_BLOCK_OR_RETURN_EOF(cb, uk, 8);
+            cb->u64 = _msgpack_be_double(cb->u64);
+            return object_complete(uk, rb_float_new(cb->d));
+        }
 
-        case 0xcd:  // unsigned int 16
-            {
-                READ_CAST_BLOCK_OR_RETURN_EOF(cb, uk, 2);
-                uint16_t u16 = _msgpack_be16(cb->u16);
-                return object_complete(uk, INT2FIX((int)u16));
-            }
+    case HEAD_UINT8:
+        {
+            READ_CAST_BLOCK_OR_RETURN_EOF(cb, uk, 1);
+            uint8_t u8 = cb->u8;
+            return object_complete(uk, INT2FIX((int)u8));
+        }
 
-        case 0xce:  // unsigned int 32
-            {
-                READ_CAST_BLOCK_OR_RETURN_EOF(cb, uk, 4);
-                uint32_t u32 = _msgpack_be32(cb->u32);
-                return object_complete(uk, ULONG2NUM((unsigned long)u32));
-            }
+    case HEAD_UINT16:
+        {
+            READ_CAST_BLOCK_OR_RETURN_EOF(cb, uk, 2);
+            uint16_t u16 = _msgpack_be16(cb->u16);
+            return object_complete(uk, INT2FIX((int)u16));
+        }
 
-        case 0xcf:  // unsigned int 64
-            {
-                READ_CAST_BLOCK_OR_RETURN_EOF(cb, uk, 8);
-                uint64_t u64 = _msgpack_be64(cb->u64);
-                return object_complete(uk, rb_ull2inum(u64));
-            }
+    case HEAD_UINT32:
+        {
+            READ_CAST_BLOCK_OR_RETURN_EOF(cb, uk, 4);
+            uint32_t u32 = _msgpack_be32(cb->u32);
+            return object_complete(uk, ULONG2NUM((unsigned long)u32));
+        }
 
-        case 0xd0:  // signed int  8
-            {
-                READ_CAST_BLOCK_OR_RETURN_EOF(cb, uk, 1);
-                int8_t i8 = cb->i8;
-                return object_complete(uk, INT2FIX((int)i8));
-            }
+    case HEAD_UINT64:
+        {
+            READ_CAST_BLOCK_OR_RETURN_EOF(cb, uk, 8);
+            uint64_t u64 = _msgpack_be64(cb->u64);
+            return object_complete(uk, rb_ull2inum(u64));
+        }
 
-        case 0xd1:  // signed int 16
-            {
-                READ_CAST_BLOCK_OR_RETURN_EOF(cb, uk, 2);
-                int16_t i16 = _msgpack_be16(cb->i16);
-                return object_complete(uk, INT2FIX((int)i16));
-            }
+    case HEAD_INT8:
+        {
+            READ_CAST_BLOCK_OR_RETURN_EOF(cb, uk, 1);
+            int8_t i8 = cb->i8;
+            return object_complete(uk, INT2FIX((int)i8));
+        }
 
-        case 0xd2:  // signed int 32
-            {
-                READ_CAST_BLOCK_OR_RETURN_EOF(cb, uk, 4);
-                int32_t i32 = _msgpack_be32(cb->i32);
-                return object_complete(uk, LONG2FIX((long)i32));
-            }
+    case HEAD_INT16:
+        {
+            READ_CAST_BLOCK_OR_RETURN_EOF(cb, uk, 2);
+            int16_t i16 = _msgpack_be16(cb->i16);
+            return object_complete(uk, INT2FIX((int)i16));
+        }
 
-        case 0xd3:  // signed int 64
-            {
-                READ_CAST_BLOCK_OR_RETURN_EOF(cb, uk, 8);
-                int64_t i64 = _msgpack_be64(cb->i64);
-                return object_complete(uk, rb_ll2inum(i64));
-            }
+    case HEAD_INT32:
+        {
+            READ_CAST_BLOCK_OR_RETURN_EOF(cb, uk, 4);
+            int32_t i32 = _msgpack_be32(cb->i32);
+            return object_complete(uk, LONG2FIX((long)i32));
+        }
 
-        //case 0xd4:
-        //case 0xd5:
-        //case 0xd6:  // big integer 16
-        //case 0xd7:  // big integer 32
-        //case 0xd8:  // big float 16
-        //case 0xd9:  // big float 32
+    case HEAD_INT64:
+        {
+            READ_CAST_BLOCK_OR_RETURN_EOF(cb, uk, 8);
+            int64_t i64 = _msgpack_be64(cb->i64);
+            return object_complete(uk, rb_ll2inum(i64));
+        }
 
-            //int n = 2 << (((unsigned int)*p) & 0x01);
-        case 0xda:  // raw 16
-            {
-                READ_CAST_BLOCK_OR_RETURN_EOF(cb, uk, 2);
-                uint16_t count = _msgpack_be16(cb->u16);
-                if(count == 0) {
-                    return object_complete(uk, rb_str_buf_new(0));
-                }
-                //uk->reading_raw = rb_str_buf_new(count);
-                uk->reading_raw_remaining = count;
-                return read_raw_body_begin(uk);
+    case HEAD_RAW16:
+        {
+            READ_CAST_BLOCK_OR_RETURN_EOF(cb, uk, 2);
+            uint16_t count = _msgpack_be16(cb->u16);
+            if(count == 0) {
+                return object_complete(uk, rb_str_buf_new(0));
             }
+            uk->reading_raw_remaining = count;
+            return read_raw_body_begin(uk);
+        }
 
-        case 0xdb:  // raw 32
-            {
-                READ_CAST_BLOCK_OR_RETURN_EOF(cb, uk, 4);
-                uint32_t count = _msgpack_be32(cb->u32);
-                if(count == 0) {
-                    return object_complete(uk, rb_str_buf_new(0));
-                }
-                //uk->reading_raw = rb_str_buf_new(count);
-                uk->reading_raw_remaining = count;
-                return read_raw_body_begin(uk);
+    case HEAD_RAW32:
+        {
+            READ_CAST_BLOCK_OR_RETURN_EOF(cb, uk, 4);
+            uint32_t count = _msgpack_be32(cb->u32);
+            if(count == 0) {
+                return object_complete(uk, rb_str_buf_new(0));
             }
+            uk->reading_raw_remaining = count;
+            return read_raw_body_begin(uk);
+        }
 
-        case 0xdc:  // array 16
-            {
-                READ_CAST_BLOCK_OR_RETURN_EOF(cb, uk, 2);
-                uint16_t count = _msgpack_be16(cb->u16);
-                if(count == 0) {
-                    return object_complete(uk, rb_ary_new());
-                }
-                return _msgpack_unpacker_stack_push(uk, STACK_TYPE_ARRAY, count, rb_ary_new2(count));
+    case HEAD_ARRAY16:
+        {
+            READ_CAST_BLOCK_OR_RETURN_EOF(cb, uk, 2);
+            uint16_t count = _msgpack_be16(cb->u16);
+            if(count == 0) {
+                return object_complete(uk, rb_ary_new());
             }
+            return _msgpack_unpacker_stack_push(uk, STACK_TYPE_ARRAY, count, rb_ary_new2(count));
+        }
 
-        case 0xdd:  // array 32
-            {
-                READ_CAST_BLOCK_OR_RETURN_EOF(cb, uk, 4);
-                uint32_t count = _msgpack_be32(cb->u32);
-                if(count == 0) {
-                    return object_complete(uk, rb_ary_new());
-                }
-                return _msgpack_unpacker_stack_push(uk, STACK_TYPE_ARRAY, count, rb_ary_new2(count));
+    case HEAD_ARRAY32:
+        {
+            READ_CAST_BLOCK_OR_RETURN_EOF(cb, uk, 4);
+            uint32_t count = _msgpack_be32(cb->u32);
+            if(count == 0) {
+                return object_complete(uk, rb_ary_new());
             }
+            return _msgpack_unpacker_stack_push(uk, STACK_TYPE_ARRAY, count, rb_ary_new2(count));
+        }
 
-        case 0xde:  // map 16
-            {
-                READ_CAST_BLOCK_OR_RETURN_EOF(cb, uk, 2);
-                uint16_t count = _msgpack_be16(cb->u16);
-                if(count == 0) {
-                    return object_complete(uk, rb_hash_new());
-                }
-                return _msgpack_unpacker_stack_push(uk, STACK_TYPE_MAP_KEY, count*2, rb_hash_new());
+    case HEAD_MAP16:
+        {
+            READ_CAST_BLOCK_OR_RETURN_EOF(cb, uk, 2);
+            uint16_t count = _msgpack_be16(cb->u16);
+            if(count == 0) {
+                return object_complete(uk, rb_hash_new());
             }
+            return _msgpack_unpacker_stack_push(uk, STACK_TYPE_MAP_KEY, count*2, rb_hash_new());
+        }
 
-        case 0xdf:  // map 32
-            {
-                READ_CAST_BLOCK_OR_RETURN_EOF(cb, uk, 4);
-                uint32_t count = _msgpack_be32(cb->u32);
-                if(count == 0) {
-                    return object_complete(uk, rb_hash_new());
-                }
-                return _msgpack_unpacker_stack_push(uk, STACK_TYPE_MAP_KEY, count*2, rb_hash_new());
+    case HEAD_MAP32:
+        {
+            READ_CAST_BLOCK_OR_RETURN_EOF(cb, uk, 4);
+            uint32_t count = _msgpack_be32(cb->u32);
+            if(count == 0) {
+                return object_complete(uk, rb_hash_new());
             }
-
-        default:
-            //printf("invalid byte: %x\n", b);
-            return PRIMITIVE_INVALID_BYTE;
+            return _msgpack_unpacker_stack_push(uk, STACK_TYPE_MAP_KEY, count*2, rb_hash_new());
         }
 
-    SWITCH_RANGE_DEFAULT
-        //printf("invalid byte: %x\n", b);
+    default:
         return PRIMITIVE_INVALID_BYTE;
-
-    SWITCH_RANGE_END
+    }
 }
 
 int msgpack_unpacker_read_array_header(msgpack_unpacker_t* uk, uint32_t* result_size)
@@ -442,7 +556,7 @@ int msgpack_unpacker_read_array_header(msgpack_unpacker_t* uk, uint32_t* result_
         return b;
     }
 
-    if(0x90 < b && b < 0x9f) {
+    if(0x90 <= b && b <= 0x9f) {
         *result_size = b & 0x0f;
 
     } else if(b == 0xdc) {
@@ -459,6 +573,7 @@ int msgpack_unpacker_read_array_header(msgpack_unpacker_t* uk, uint32_t* result_
         return PRIMITIVE_UNEXPECTED_TYPE;
     }
 
+    reset_head_byte(uk);
     return 0;
 }
 
@@ -469,7 +584,7 @@ int msgpack_unpacker_read_map_header(msgpack_unpacker_t* uk, uint32_t* result_si
         return b;
     }
 
-    if(0x80 < b && b < 0x8f) {
+    if(0x80 <= b && b <= 0x8f) {
         *result_size = b & 0x0f;
 
     } else if(b == 0xde) {
@@ -486,9 +601,77 @@ int msgpack_unpacker_read_map_header(msgpack_unpacker_t* uk, uint32_t* result_si
         return PRIMITIVE_UNEXPECTED_TYPE;
     }
 
+    reset_head_byte(uk);
     return 0;
 }
 
+/* elements decoded between two rb_ary_cat calls */
+#define NUMERIC_RUN_BATCH 64
+
+/*
+ * Decodes up to _max_ (at most NUMERIC_RUN_BATCH) fixints or doubles in a
+ * row from the top chunk to _batch_ and returns how many. The head byte
+ * must not have been read.
+ */
+static size_t numeric_run(msgpack_unpacker_t* uk, VALUE* batch, size_t max)
+{
+    msgpack_buffer_t* b = UNPACKER_BUFFER_(uk);
+    size_t readable = msgpack_buffer_top_readable_size(b);
+    if(readable == 0) {
+        return 0;
+    }
+
+    const char* p = b->read_buffer;
+    size_t n = 0;
+    size_t used = 0;
+
+    if(msgpack_simd_is_fixint(p[0])) {
+        n = used = msgpack_simd_fixint_run(p, max < readable ? max : readable);
+        msgpack_simd_fixints_to_values(p, n, batch);
+    } else {
+        while(n < max && readable - used >= 9 && (unsigned char)p[used] == 0xcb) {
+            union msgpack_buffer_cast_block_t cb;
+            memcpy(cb.buffer, p + used + 1, 8);
+            cb.u64 = _msgpack_be_double(cb.u64);
+            batch[n++] = rb_float_new(cb.d);
+            used += 9;
+        }
+    }
+
+    _msgpack_buffer_consumed(b, used);
+    return n;
+}
+
+/*
+ * Appends the run of fixints or doubles an array starts with straight to
+ * it, instead of going through read_primitive element by element. Stops
+ * at the first other element or at the end of the top chunk; the rest is
+ * read as usual. Returns true if the run covered the whole array, which
+ * is then completed and popped.
+ */
+static bool read_numeric_run(msgpack_unpacker_t* uk)
+{
+    msgpack_unpacker_stack_t* top = _msgpack_unpacker_stack_top(uk);
+    VALUE batch[NUMERIC_RUN_BATCH];
+
+    while(top->count > 0) {
+        size_t n = numeric_run(uk, batch,
+                top->count < NUMERIC_RUN_BATCH ? top->count : NUMERIC_RUN_BATCH);
+        if(n == 0) {
+            break;
+        }
+        rb_ary_cat(top->object, batch, n);
+        top->count -= n;
+    }
+
+    if(top->count > 0) {
+        return false;
+    }
+    object_complete(uk, top->object);
+    msgpack_unpacker_stack_pop(uk);
+    return true;
+}
+
 int msgpack_unpacker_read(msgpack_unpacker_t* uk, size_t target_stack_depth)
 {
     while(true) {
@@ -498,11 +681,14 @@ int msgpack_unpacker_read(msgpack_unpacker_t* uk, size_t target_stack_depth)
         }
         if(r == PRIMITIVE_CONTAINER_START) {
 //printf("container start count=%lu\n", _msgpack_unpacker_stack_top(uk)->count);
-            continue;
+            if(_msgpack_unpacker_stack_top(uk)->type != STACK_TYPE_ARRAY || !read_numeric_run(uk)) {
+                continue;
+            }
+            /* the array is complete */
         }
         /* PRIMITIVE_OBJECT_COMPLETE */
 
-        if(msgpack_unpacker_stack_is_empty(uk)) {
+        if(uk->stack_depth <= target_stack_depth) {
             return PRIMITIVE_OBJECT_COMPLETE;
         }
 
@@ -515,6 +701,10 @@ int msgpack_unpacker_read(msgpack_unpacker_t* uk, size_t target_stack_depth)
                 break;
             case STACK_TYPE_MAP_KEY:
                 top->key = uk->last_object;
+                if(uk->symbolize_keys && rb_type(top->key) == T_STRING) {
+                    /* too long for the symbol table or split across chunks */
+                    top->key = rb_str_intern(top->key);
+                }
                 top->type = STACK_TYPE_MAP_VALUE;
                 break;
             case STACK_TYPE_MAP_VALUE:
@@ -536,10 +726,156 @@ int msgpack_unpacker_read(msgpack_unpacker_t* uk, size_t target_stack_depth)
     }
 }
 
+/* skip functions: advance the buffer without creating objects */
+static int skip_raw_body(msgpack_unpacker_t* uk)
+{
+    size_t length = uk->reading_raw_remaining;
+
+    do {
+        size_t n = msgpack_buffer_skip(UNPACKER_BUFFER_(uk), length);
+        if(n == 0) {
+            return PRIMITIVE_EOF;
+        }
+        uk->reading_raw_remaining = length = length - n;
+    } while(length > 0);
+
+    return object_complete(uk, Qnil);
+}
+
+static inline int skip_raw_body_begin(msgpack_unpacker_t* uk, size_t count)
+{
+    if(count == 0) {
+        return object_complete(uk, Qnil);
+    }
+    uk->reading_raw_remaining = count;
+    return skip_raw_body(uk);
+}
+
+#define SKIP_CAST_BLOCK_OR_RETURN_EOF(uk, n) \
+    { \
+        READ_CAST_BLOCK_OR_RETURN_EOF(cb, uk, n); \
+        return object_complete(uk, Qnil); \
+    }
+
+static int skip_primitive(msgpack_unpacker_t* uk)
+{
+    if(uk->reading_raw_remaining > 0) {
+        return skip_raw_body(uk);
+    }
+
+    int b = get_head_byte(uk);
+    if(b < 0) {
+        return b;
+    }
+
+    switch(head_byte_kinds[b]) {
+    case HEAD_POSITIVE_FIXNUM:
+    case HEAD_NEGATIVE_FIXNUM:
+    case HEAD_NIL:
+    case HEAD_FALSE:
+    case HEAD_TRUE:
+        return object_complete(uk, Qnil);
+
+    case HEAD_FIXRAW:
+        return skip_raw_body_begin(uk, b & 0x1f);
+
+    case HEAD_FIXARRAY:
+        {
+            int count = b & 0x0f;
+            if(count == 0) {
+                return object_complete(uk, Qnil);
+            }
+            return _msgpack_unpacker_stack_push(uk, STACK_TYPE_ARRAY, count, Qnil);
+        }
+
+    case HEAD_FIXMAP:
+        {
+            int count = b & 0x0f;
+            if(count == 0) {
+                return object_complete(uk, Qnil);
+            }
+            return _msgpack_unpacker_stack_push(uk, STACK_TYPE_MAP_KEY, count*2, Qnil);
+        }
+
+    case HEAD_UINT8:
+    case HEAD_INT8:
+        SKIP_CAST_BLOCK_OR_RETURN_EOF(uk, 1);
+
+    case HEAD_UINT16:
+    case HEAD_INT16:
+        SKIP_CAST_BLOCK_OR_RETURN_EOF(uk, 2);
+
+    case HEAD_FLOAT:
+    case HEAD_UINT32:
+    case HEAD_INT32:
+        SKIP_CAST_BLOCK_OR_RETURN_EOF(uk, 4);
+
+    case HEAD_DOUBLE:
+    case HEAD_UINT64:
+    case HEAD_INT64:
+        SKIP_CAST_BLOCK_OR_RETURN_EOF(uk, 8);
+
+    case HEAD_RAW16:
+        {
+            READ_CAST_BLOCK_OR_RETURN_EOF(cb, uk, 2);
+            return skip_raw_body_begin(uk, _msgpack_be16(cb->u16));
+        }
+
+    case HEAD_RAW32:
+        {
+            READ_CAST_BLOCK_OR_RETURN_EOF(cb, uk, 4);
+            return skip_raw_body_begin(uk, _msgpack_be32(cb->u32));
+        }
+
+    case HEAD_ARRAY16:
+        {
+            READ_CAST_BLOCK_OR_RETURN_EOF(cb, uk, 2);
+            uint16_t count = _msgpack_be16(cb->u16);
+            if(count == 0) {
+                return object_complete(uk, Qnil);
+            }
+            return _msgpack_unpacker_stack_push(uk, STACK_TYPE_ARRAY, count, Qnil);
+        }
+
+    case HEAD_ARRAY32:
+        {
+            READ_CAST_BLOCK_OR_RETURN_EOF(cb, uk, 4);
+            uint32_t count = _msgpack_be32(cb->u32);
+            if(count == 0) {
+                return object_complete(uk, Qnil);
+            }
+            return _msgpack_unpacker_stack_push(uk, STACK_TYPE_ARRAY, count, Qnil);
+        }
+
+    case HEAD_MAP16:
+        {
+            READ_CAST_BLOCK_OR_RETURN_EOF(cb, uk, 2);
+            uint16_t count = _msgpack_be16(cb->u16);
+            if(count == 0) {
+                return object_complete(uk, Qnil);
+            }
+            return _msgpack_unpacker_stack_push(uk, STACK_TYPE_MAP_KEY, count*2, Qnil);
+        }
+
+    case HEAD_MAP32:
+        {
+            READ_CAST_BLOCK_OR_RETURN_EOF(cb, uk, 4);
+            uint32_t count = _msgpack_be32(cb->u32);
+            if(count == 0) {
+                return object_complete(uk, Qnil);
+            }
+            return _msgpack_unpacker_stack_push(uk, STACK_TYPE_MAP_KEY, count*2, Qnil);
+        }
+
+    default:
+        return PRIMITIVE_INVALID_BYTE;
+    }
+}
+
 int msgpack_unpacker_skip(msgpack_unpacker_t* uk, size_t target_stack_depth)
 {
     while(true) {
-        int r = read_primitive(uk);
+        int r = skip_primitive(uk);
         if(r < 0) {
             return r;
         }
@@ -548,15 +884,13 @@ int msgpack_unpacker_skip(msgpack_unpacker_t* uk, size_t target_stack_depth)
         }
         /* PRIMITIVE_OBJECT_COMPLETE */
 
-        if(msgpack_unpacker_stack_is_empty(uk)) {
+        if(uk->stack_depth <= target_stack_depth) {
             return PRIMITIVE_OBJECT_COMPLETE;
         }
 
         container_completed:
         {
             msgpack_unpacker_stack_t* top = _msgpack_unpacker_stack_top(uk);
-            /* deleted section */
-            /* TODO optimize: #define SKIP and #include unpacker_incl.h */
             size_t count = --top->count;
 
             if(count == 0) {
@@ -570,74 +904,683 @@ int msgpack_unpacker_skip(msgpack_unpacker_t* uk, size_t target_stack_depth)
     }
 }
 
-int msgpack_unpacker_peek_next_object_type(msgpack_unpacker_t* uk)
+static inline VALUE projection_child(VALUE node, VALUE key)
 {
-    int b = get_head_byte(uk);
-    if(b < 0) {
-        return b;
+    if(SYMBOL_P(key)) {
+        key = rb_sym2str(key);  /* decoded with symbolize_keys */
     }
+    VALUE child = rb_hash_lookup2(node, key, Qundef);
+    if(child == Qundef) {
+        child = rb_hash_lookup2(node, ID2SYM(rb_intern("*")), Qundef);
+    }
+    return child;
+}
 
-    SWITCH_RANGE_BEGIN(b)
-    SWITCH_RANGE(b, 0x00, 0x7f)  // Positive Fixnum
-        return TYPE_INTEGER;
+int msgpack_unpacker_read_projected(msgpack_unpacker_t* uk, VALUE projection)
+{
+    if(rb_type(projection) != T_HASH) {
+        /* selected as a whole */
+        return msgpack_unpacker_read(uk, uk->stack_depth);
+    }
 
-    SWITCH_RANGE(b, 0xe0, 0xff)  // Negative Fixnum
-        return TYPE_INTEGER;
+    int r = read_primitive(uk);
+    if(r != PRIMITIVE_CONTAINER_START) {
+        /* errors, or a scalar or an empty container on a selected path */
+        return r;
+    }
 
-    SWITCH_RANGE(b, 0xa0, 0xbf)  // FixRaw
-        return TYPE_RAW;
+    /* children are read here instead of by the loop in
+     * msgpack_unpacker_read, so the entry just pushed keeps its count.
+     * nested calls may reallocate the stack: don't keep pointers to it */
+    size_t depth = uk->stack_depth;
+    size_t count = uk->stack[depth-1].count;
+    VALUE object = uk->stack[depth-1].object;
+
+    if(uk->stack[depth-1].type == STACK_TYPE_ARRAY) {
+        for(size_t i = 0; i < count; i++) {
+            VALUE child = projection_child(projection, ULONG2NUM((unsigned long) i));
+            if(child == Qundef) {
+                r = msgpack_unpacker_skip(uk, depth);
+            } else {
+                r = msgpack_unpacker_read_projected(uk, child);
+            }
+            if(r < 0) {
+                return r;
+            }
+            if(child != Qundef) {
+                rb_ary_push(object, uk->last_object);
+            }
+        }
 
-    SWITCH_RANGE(b, 0x90, 0x9f)  // FixArray
-        return TYPE_ARRAY;
+    } else {
+        for(size_t i = 0; i < count; i += 2) {
+            uk->stack[depth-1].type = STACK_TYPE_MAP_KEY;
+            r = msgpack_unpacker_read(uk, depth);
+            if(r < 0) {
+                return r;
+            }
+            VALUE key = uk->last_object;
+            if(uk->symbolize_keys && rb_type(key) == T_STRING) {
+                key = rb_str_intern(key);
+            }
+            uk->stack[depth-1].key = key;  /* marked while the value is read */
+            uk->stack[depth-1].type = STACK_TYPE_MAP_VALUE;
+
+            VALUE child = projection_child(projection, key);
+            if(child == Qundef) {
+                r = msgpack_unpacker_skip(uk, depth);
+            } else {
+                r = msgpack_unpacker_read_projected(uk, child);
+            }
+            if(r < 0) {
+                return r;
+            }
+            if(child != Qundef) {
+                rb_hash_aset(object, key, uk->last_object);
+            }
+        }
+    }
+
+    msgpack_unpacker_stack_pop(uk);
+    return object_complete(uk, object);
+}
+
+static int walk_structure(const char* data, size_t length, size_t depth_max,
+        msgpack_unpacker_tape_t* tape);
+
+/* bytes copied at first to walk an object spanning chunks, doubled as needed */
+#define BUFFERED_WALK_INITIAL 4096
+
+/*
+ * Returns PRIMITIVE_EOF, consuming nothing, unless the next object is
+ * buffered whole. Readers that can't resume after PRIMITIVE_EOF check this
+ * first. With an IO, EOF means the IO has ended, and there's nothing to
+ * check. Invalid data is left to be found by the reader.
+ */
+static int next_object_buffered(msgpack_unpacker_t* uk)
+{
+    msgpack_buffer_t* b = UNPACKER_BUFFER_(uk);
+    if(msgpack_buffer_has_io(b)) {
+        return PRIMITIVE_OBJECT_COMPLETE;
+    }
+
+    /* the depth of the reader is checked by the reader */
+    size_t depth_max = uk->stack_depth_max + 1;
+    size_t head = uk->head_byte != HEAD_BYTE_REQUIRED ? 1 : 0;
+    size_t top = msgpack_buffer_top_readable_size(b);
+
+    if(head == 0) {
+        int r = walk_structure(b->read_buffer, top, depth_max, NULL);
+        if(r != PRIMITIVE_EOF) {
+            return PRIMITIVE_OBJECT_COMPLETE;
+        }
+    }
+
+    /* the object spans chunks: walk a copy, growing it until the object
+     * fits so that an object near the head doesn't copy the whole buffer */
+    size_t all = head + msgpack_buffer_all_readable_size(b);
+    if(all == head + top && head == 0) {
+        return PRIMITIVE_EOF;
+    }
+    size_t length = head + top;
+    if(length < BUFFERED_WALK_INITIAL) {
+        length = BUFFERED_WALK_INITIAL;
+    }
+
+    VALUE scratch = rb_str_buf_new(0);
+    while(true) {
+        if(length > all) {
+            length = all;
+        }
+        rb_str_resize(scratch, length);
+        char* p = RSTRING_PTR(scratch);
+        if(head) {
+            p[0] = (char) uk->head_byte;
+        }
+        msgpack_buffer_peek_nonblock(b, p + head, length - head);
+
+        int r = walk_structure(p, length, depth_max, NULL);
+        if(r != PRIMITIVE_EOF) {
+            break;
+        }
+        if(length == all) {
+            return PRIMITIVE_EOF;
+        }
+        length *= 2;
+    }
+
+    RB_GC_GUARD(scratch);
+    return PRIMITIVE_OBJECT_COMPLETE;
+}
+
+/* the column of _key_, created with _rows_ nils if it's new */
+static VALUE column_of(VALUE columns, VALUE key, size_t rows)
+{
+    VALUE column = rb_hash_lookup2(columns, key, Qundef);
+    if(column == Qundef) {
+        column = rb_ary_new();
+        if(rows > 0) {
+            rb_ary_store(column, (long) rows - 1, Qnil);
+        }
+        rb_hash_aset(columns, key, column);
+    }
+    return column;
+}
+
+int msgpack_unpacker_read_columns(msgpack_unpacker_t* uk, VALUE columns)
+{
+    int r = next_object_buffered(uk);
+    if(r < 0) {
+        return r;
+    }
+
+    uint32_t rows;
+    r = msgpack_unpacker_read_array_header(uk, &rows);
+    if(r < 0) {
+        return r;
+    }
+
+    /* keys and columns of the previous row by position: rows usually
+     * have the same keys in the same order, and interned keys are the
+     * same objects, so they're matched without a Hash lookup */
+    VALUE keys = rb_ary_new();
+    VALUE key_columns = rb_ary_new();
+
+    for(size_t row = 0; row < rows; row++) {
+        uint32_t count;
+        r = msgpack_unpacker_read_map_header(uk, &count);
+        if(r == PRIMITIVE_UNEXPECTED_TYPE) {
+            /* skip the rest of the rows, which are buffered, so that the
+             * next object can be read */
+            for(; row < rows; row++) {
+                int s = msgpack_unpacker_skip(uk, uk->stack_depth);
+                if(s < 0) {
+                    return s;
+                }
+            }
+            return r;
+        }
+        if(r < 0) {
+            return r;
+        }
+
+        /* entries are read as those of a map without creating one. nested
+         * calls may reallocate the stack: don't keep pointers to it */
+        r = _msgpack_unpacker_stack_push(uk, STACK_TYPE_MAP_KEY, (size_t) count * 2, Qnil);
+        if(r < 0) {
+            return r;
+        }
+        size_t depth = uk->stack_depth;
+
+        for(long i = 0; i < (long) count; i++) {
+            uk->stack[depth-1].type = STACK_TYPE_MAP_KEY;
+            r = msgpack_unpacker_read(uk, depth);
+            if(r < 0) {
+                return r;
+            }
+            VALUE key = uk->last_object;
+            if(uk->symbolize_keys && rb_type(key) == T_STRING) {
+                key = rb_str_intern(key);
+            }
+            uk->stack[depth-1].key = key;  /* marked while the value is read */
+
+            VALUE column;
+            if(i < RARRAY_LEN(keys) && rb_ary_entry(keys, i) == key) {
+                column = rb_ary_entry(key_columns, i);
+            } else {
+                column = column_of(columns, key, row);
+                rb_ary_store(keys, i, key);
+                rb_ary_store(key_columns, i, column);
+            }
+
+            uk->stack[depth-1].type = STACK_TYPE_MAP_VALUE;
+            r = msgpack_unpacker_read(uk, depth);
+            if(r < 0) {
+                return r;
+            }
+            rb_ary_store(column, (long) row, uk->last_object);
+        }
+
+        msgpack_unpacker_stack_pop(uk);
+    }
+
+    /* keys missing from the last rows */
+    VALUE all = rb_funcall(columns, rb_intern("values"), 0);
+    for(long i = 0; i < RARRAY_LEN(all); i++) {
+        VALUE column = rb_ary_entry(all, i);
+        if(rows > 0 && RARRAY_LEN(column) < (long) rows) {
+            rb_ary_store(column, (long) rows - 1, Qnil);
+        }
+    }
+
+    return object_complete(uk, columns);
+}
+
+static int read_into_container(msgpack_unpacker_t* uk, VALUE target);
+
+/* reads the next object, refilling _old_ if it can hold the object */
+static int read_into_value(msgpack_unpacker_t* uk, VALUE old)
+{
+    int type = msgpack_unpacker_peek_next_object_type(uk);
+    if(type < 0) {
+        return type;
+    }
+
+    /* Strings aren't refilled: the caller may hold those of the previous
+     * object */
+    if(!OBJ_FROZEN(old) && ((type == TYPE_ARRAY && rb_type(old) == T_ARRAY) ||
+                (type == TYPE_MAP && rb_type(old) == T_HASH))) {
+        return read_into_container(uk, old);
+    }
+
+    return msgpack_unpacker_read(uk, uk->stack_depth);
+}
+
+struct read_into_keys_args {
+    VALUE keys;
+    long index;
+    bool same;
+};
+
+static int read_into_compare_key(VALUE key, VALUE value, VALUE data)
+{
+    UNUSED(value);
+    struct read_into_keys_args* args = (struct read_into_keys_args*) data;
+    VALUE k = rb_ary_entry(args->keys, args->index++);
+    if(k != key && !rb_eql(k, key)) {
+        args->same = false;
+        return ST_STOP;
+    }
+    return ST_CONTINUE;
+}
+
+/*
+ * true if the keys of _target_ are keys[from..] in the same order, which
+ * is the case when a target is refilled with maps of the same shape.
+ * Then there are no duplicates among them and no stale entries
+ */
+static bool read_into_same_keys(VALUE target, VALUE keys, long from)
+{
+    if((long) RHASH_SIZE(target) != RARRAY_LEN(keys) - from) {
+        return false;
+    }
+    struct read_into_keys_args args = { keys, from, true };
+    rb_hash_foreach(target, read_into_compare_key, (VALUE) &args);
+    return args.same;
+}
 
-    SWITCH_RANGE(b, 0x80, 0x8f)  // FixMap
-        return TYPE_MAP;
+static int read_into_delete_stale(VALUE key, VALUE value, VALUE set)
+{
+    UNUSED(value);
+    return rb_hash_lookup2(set, key, Qundef) == Qundef ? ST_DELETE : ST_CONTINUE;
+}
 
-    SWITCH_RANGE(b, 0xc0, 0xdf)  // Variable
-        switch(b) {
-        case 0xc0:  // nil
-            return TYPE_NIL;
+/* removes the entries of _target_ whose keys aren't among keys[from..] */
+static void read_into_remove_stale(msgpack_unpacker_t* uk, VALUE target, VALUE keys, long from)
+{
+    if(uk->read_into_set == Qnil) {
+        uk->read_into_set = rb_hash_new();
+    }
+    VALUE set = uk->read_into_set;
+    rb_hash_clear(set);  /* left over by an error */
+    for(long i = from; i < RARRAY_LEN(keys); i++) {
+        rb_hash_aset(set, rb_ary_entry(keys, i), Qtrue);
+    }
+    rb_hash_foreach(target, read_into_delete_stale, set);
+    rb_hash_clear(set);
+}
 
-        case 0xc2:  // false
-        case 0xc3:  // true
-            return TYPE_BOOLEAN;
+static int read_into_container(msgpack_unpacker_t* uk, VALUE target)
+{
+    uint32_t count;
+    bool map = rb_type(target) == T_HASH;
+    int r = map ? msgpack_unpacker_read_map_header(uk, &count) :
+        msgpack_unpacker_read_array_header(uk, &count);
+    if(r < 0) {
+        return r;
+    }
 
-        case 0xca:  // float
-        case 0xcb:  // double
-            return TYPE_FLOAT;
+    /* entries are read as those of a new container would be. nested
+     * calls may reallocate the stack: don't keep pointers to it */
+    r = _msgpack_unpacker_stack_push(uk, map ? STACK_TYPE_MAP_KEY : STACK_TYPE_ARRAY,
+            map ? (size_t) count * 2 : count, target);
+    if(r < 0) {
+        return r;
+    }
+    size_t depth = uk->stack_depth;
+
+    if(!map) {
+        for(long i = 0; i < (long) count; ) {
+            /* numbers take the place of whatever was there */
+            VALUE batch[NUMERIC_RUN_BATCH];
+            size_t rest = (size_t) count - i;
+            size_t n = uk->head_byte == HEAD_BYTE_REQUIRED ?
+                numeric_run(uk, batch, rest < NUMERIC_RUN_BATCH ? rest : NUMERIC_RUN_BATCH) : 0;
+            if(n > 0) {
+                for(size_t j = 0; j < n; j++) {
+                    rb_ary_store(target, i++, batch[j]);
+                }
+                continue;
+            }
 
-        case 0xcc:  // unsigned int  8
-        case 0xcd:  // unsigned int 16
-        case 0xce:  // unsigned int 32
-        case 0xcf:  // unsigned int 64
-            return TYPE_INTEGER;
+            VALUE old = i < RARRAY_LEN(target) ? rb_ary_entry(target, i) : Qnil;
+            r = read_into_value(uk, old);
+            if(r < 0) {
+                return r;
+            }
+            rb_ary_store(target, i++, uk->last_object);
+        }
+        if(RARRAY_LEN(target) > (long) count) {
+            rb_ary_resize(target, count);
+        }
 
-        case 0xd0:  // signed int  8
-        case 0xd1:  // signed int 16
-        case 0xd2:  // signed int 32
-        case 0xd3:  // signed int 64
-            return TYPE_INTEGER;
+    } else {
+        VALUE keys = uk->read_into_keys;
+        long from = RARRAY_LEN(keys);
+
+        for(uint32_t i = 0; i < count; i++) {
+            uk->stack[depth-1].type = STACK_TYPE_MAP_KEY;
+            r = msgpack_unpacker_read(uk, depth);
+            if(r < 0) {
+                return r;
+            }
+            VALUE key = uk->last_object;
+            if(uk->symbolize_keys && rb_type(key) == T_STRING) {
+                key = rb_str_intern(key);
+            }
+            uk->stack[depth-1].key = key;  /* marked while the value is read */
+            uk->stack[depth-1].type = STACK_TYPE_MAP_VALUE;
+            rb_ary_push(keys, key);
+
+            r = read_into_value(uk, rb_hash_lookup2(target, key, Qnil));
+            if(r < 0) {
+                return r;
+            }
+            rb_hash_aset(target, key, uk->last_object);
+        }
 
-        case 0xda:  // raw 16
-        case 0xdb:  // raw 32
-            return TYPE_RAW;
+        if(!read_into_same_keys(target, keys, from)) {
+            read_into_remove_stale(uk, target, keys, from);
+        }
+        rb_ary_resize(keys, from);
+    }
 
-        case 0xdc:  // array 16
-        case 0xdd:  // array 32
-            return TYPE_ARRAY;
+    msgpack_unpacker_stack_pop(uk);
+    return object_complete(uk, target);
+}
 
-        case 0xde:  // map 16
-        case 0xdf:  // map 32
-            return TYPE_MAP;
+int msgpack_unpacker_read_into(msgpack_unpacker_t* uk, VALUE target)
+{
+    int r = next_object_buffered(uk);
+    if(r < 0) {
+        return r;
+    }
+
+    int type = msgpack_unpacker_peek_next_object_type(uk);
+    if(type < 0) {
+        return type;
+    }
+    if(type != (rb_type(target) == T_HASH ? TYPE_MAP : TYPE_ARRAY)) {
+        return PRIMITIVE_UNEXPECTED_TYPE;
+    }
+
+    if(uk->read_into_keys == Qnil) {
+        uk->read_into_keys = rb_ary_new();
+    }
+    /* left over by an error */
+    rb_ary_resize(uk->read_into_keys, 0);
+
+    return read_into_container(uk, target);
+}
+
+static inline size_t walk_read_be(const char* p, size_t n)
+{
+    union msgpack_buffer_cast_block_t cb;
+    memcpy(cb.buffer, p, n);
+    return n == 2 ? _msgpack_be16(cb.u16) : _msgpack_be32(cb.u32);
+}
+
+typedef struct {
+    size_t count;  /* entries left */
+    size_t entry;  /* on the tape */
+} walk_stack_t;
+
+static bool tape_reserve(msgpack_unpacker_tape_t* tape, size_t n)
+{
+    if(tape->capacity - tape->count >= n) {
+        return true;
+    }
+    size_t capacity = tape->capacity == 0 ? 64 : tape->capacity;
+    while(capacity - tape->count < n) {
+        capacity *= 2;
+    }
+    msgpack_unpacker_tape_entry_t* entries = (msgpack_unpacker_tape_entry_t*) realloc(tape->entries,
+            capacity * sizeof(msgpack_unpacker_tape_entry_t));
+    if(entries == NULL) {
+        return false;
+    }
+    tape->entries = entries;
+    tape->capacity = capacity;
+    return true;
+}
+
+/*
+ * Walks the object in _data_ without creating any object, recording an
+ * entry for each value to _tape_ unless it's NULL.
+ */
+static int walk_structure(const char* data, size_t length, size_t depth_max,
+        msgpack_unpacker_tape_t* tape)
+{
+    const char* p = data;
+    const char* const end = data + length;
+
+    /* open containers */
+    walk_stack_t* stack = NULL;
+    size_t depth = 0;
+    size_t capacity = 0;
+
+    /* sum of the stack: each entry takes a byte at least */
+    size_t pending = 0;
+
+    int r = PRIMITIVE_OBJECT_COMPLETE;
+
+    while(true) {
+        if(p == end) {
+            r = PRIMITIVE_EOF;
+            break;
+        }
+
+        size_t left = end - p;
+        int b = (unsigned char) *p;
+        size_t values = 1;  /* entries of the open container completed */
+        size_t size = 1;    /* bytes taken including the head byte */
+        size_t count = 0;   /* entries of a container starting here */
+
+        switch(head_byte_kinds[b]) {
+        case HEAD_POSITIVE_FIXNUM:
+        case HEAD_NEGATIVE_FIXNUM:
+            if(depth > 0) {
+                /* a run of fixints completes as many entries at once */
+                size_t max = stack[depth-1].count < left ? stack[depth-1].count : left;
+                values = size = msgpack_simd_fixint_run(p, max);
+            }
+            break;
+
+        case HEAD_NIL:
+        case HEAD_FALSE:
+        case HEAD_TRUE:
+            break;
+
+        case HEAD_FIXRAW:
+            size += b & 0x1f;
+            break;
+
+        case HEAD_UINT8:
+        case HEAD_INT8:
+            size += 1;
+            break;
+
+        case HEAD_UINT16:
+        case HEAD_INT16:
+            size += 2;
+            break;
+
+        case HEAD_FLOAT:
+        case HEAD_UINT32:
+        case HEAD_INT32:
+            size += 4;
+            break;
+
+        case HEAD_DOUBLE:
+        case HEAD_UINT64:
+        case HEAD_INT64:
+            size += 8;
+            break;
+
+        case HEAD_RAW16:
+        case HEAD_RAW32:
+            {
+                size_t n = head_byte_kinds[b] == HEAD_RAW16 ? 2 : 4;
+                if(left <= n) {
+                    r = PRIMITIVE_EOF;
+                    goto out;
+                }
+                size += n + walk_read_be(p + 1, n);
+            }
+            break;
+
+        case HEAD_FIXARRAY:
+            count = b & 0x0f;
+            break;
+
+        case HEAD_FIXMAP:
+            count = (b & 0x0f) * 2;
+            break;
+
+        case HEAD_ARRAY16:
+        case HEAD_ARRAY32:
+        case HEAD_MAP16:
+        case HEAD_MAP32:
+            {
+                size_t n = (head_byte_kinds[b] == HEAD_ARRAY16 || head_byte_kinds[b] == HEAD_MAP16) ? 2 : 4;
+                if(left <= n) {
+                    r = PRIMITIVE_EOF;
+                    goto out;
+                }
+                size += n;
+                count = walk_read_be(p + 1, n);
+                if(count > left) {
+                    r = PRIMITIVE_EOF;
+                    goto out;
+                }
+                if(head_byte_kinds[b] == HEAD_MAP16 || head_byte_kinds[b] == HEAD_MAP32) {
+                    count *= 2;
+                }
+            }
+            break;
 
         default:
-            return PRIMITIVE_INVALID_BYTE;
+            r = PRIMITIVE_INVALID_BYTE;
+            goto out;
         }
 
-    SWITCH_RANGE_DEFAULT
-        return PRIMITIVE_INVALID_BYTE;
+        if(size > left) {
+            r = PRIMITIVE_EOF;
+            break;
+        }
 
-    SWITCH_RANGE_END
+        if(tape != NULL) {
+            if(!tape_reserve(tape, values)) {
+                free(stack);
+                rb_memerror();
+            }
+            /* a container is followed by its children; fixed up when popped */
+            for(size_t i = 0; i < values; i++) {
+                msgpack_unpacker_tape_entry_t* e = &tape->entries[tape->count];
+                e->offset = (p - data) + i;
+                e->next = ++tape->count;
+            }
+        }
+        p += size;
+
+        if(depth > 0) {
+            stack[depth-1].count -= values;
+            pending -= values;
+        }
+
+        if(count > 0) {
+            if(depth >= depth_max) {
+                r = PRIMITIVE_STACK_TOO_DEEP;
+                break;
+            }
+            if(depth == capacity) {
+                capacity = capacity == 0 ? MSGPACK_UNPACKER_STACK_CAPACITY : capacity * 2;
+                walk_stack_t* grown = (walk_stack_t*) realloc(stack, capacity * sizeof(walk_stack_t));
+                if(grown == NULL) {
+                    free(stack);
+                    rb_memerror();
+                }
+                stack = grown;
+            }
+            stack[depth].count = count;
+            stack[depth].entry = tape != NULL ? tape->count - 1 : 0;
+            depth++;
+            pending += count;
+        }
+
+        /* rejects counts the rest of the input can't hold before
+         * anything is allocated for them */
+        if(pending > (size_t) (end - p)) {
+            r = PRIMITIVE_EOF;
+            break;
+        }
+
+        while(depth > 0 && stack[depth-1].count == 0) {
+            depth--;
+            if(tape != NULL) {
+                tape->entries[stack[depth].entry].next = tape->count;
+            }
+        }
+        if(depth == 0) {
+            if(p != end) {
+                r = PRIMITIVE_EXTRA_BYTES;
+            }
+            break;
+        }
+    }
+
+out:
+    free(stack);
+    return r;
+}
+
+int msgpack_unpacker_validate(const char* data, size_t length, size_t depth_max)
+{
+    return walk_structure(data, length, depth_max, NULL);
+}
+
+int msgpack_unpacker_build_tape(const char* data, size_t length, size_t depth_max,
+        msgpack_unpacker_tape_t* tape)
+{
+    tape->count = 0;
+    return walk_structure(data, length, depth_max, tape);
+}
+
+void msgpack_unpacker_tape_destroy(msgpack_unpacker_tape_t* tape)
+{
+    free(tape->entries);
+    tape->entries = NULL;
+    tape->count = 0;
+    tape->capacity = 0;
+}
+
+int msgpack_unpacker_peek_next_object_type(msgpack_unpacker_t* uk)
+{
+    int b = get_head_byte(uk);
+    if(b < 0) {
+        return b;
+    }
+    return head_kind_types[head_byte_kinds[b]];
 }
 
 int msgpack_unpacker_skip_nil(msgpack_unpacker_t* uk)
@@ -647,8 +1590,70 @@ int msgpack_unpacker_skip_nil(msgpack_unpacker_t* uk)
         return b;
     }
     if(b == 0xc0) {
+        reset_head_byte(uk);
         return 1;
     }
     return 0;
 }
 
+int msgpack_unpacker_read_scalar(msgpack_unpacker_t* uk, enum msgpack_unpacker_object_type type)
+{
+    if(uk->reading_raw_remaining > 0) {
+        return PRIMITIVE_UNEXPECTED_TYPE;
+    }
+
+    int b = get_head_byte(uk);
+    if(b < 0) {
+        return b;
+    }
+    if(head_kind_types[head_byte_kinds[b]] != type) {
+        return PRIMITIVE_UNEXPECTED_TYPE;
+    }
+    return read_primitive(uk);
+}
+
+int msgpack_unpacker_read_string_into(msgpack_unpacker_t* uk, VALUE string)
+{
+    if(uk->reading_raw_remaining > 0) {
+        /* resume a raw cut short by PRIMITIVE_EOF */
+        return read_raw_body_cont(uk);
+    }
+
+    int b = get_head_byte(uk);
+    if(b < 0) {
+        return b;
+    }
+
+    size_t count;
+    switch(head_byte_kinds[b]) {
+    case HEAD_FIXRAW:
+        count = b & 0x1f;
+        break;
+
+    case HEAD_RAW16:
+        {
+            READ_CAST_BLOCK_OR_RETURN_EOF(cb, uk, 2);
+            count = _msgpack_be16(cb->u16);
+        }
+        break;
+
+    case HEAD_RAW32:
+        {
+            READ_CAST_BLOCK_OR_RETURN_EOF(cb, uk, 4);
+            count = _msgpack_be32(cb->u32);
+        }
+        break;
+
+    default:
+        return PRIMITIVE_UNEXPECTED_TYPE;
+    }
+
+    rb_str_resize(string, 0);
+    if(count == 0) {
+        return object_complete(uk, string);
+    }
+    uk->reading_raw = string;
+    uk->reading_raw_remaining = count;
+    return read_raw_body_cont(uk);
+}
+
@@ -20,8 +20,14 @@
 
 #include "buffer.hh"
 
+/* the stack starts with this many entries and doubles as needed */
 #ifndef MSGPACK_UNPACKER_STACK_CAPACITY
-#define MSGPACK_UNPACKER_STACK_CAPACITY 128
+#define MSGPACK_UNPACKER_STACK_CAPACITY 8
+#endif
+
+/* default nesting limit, set per unpacker by the max_depth option */
+#ifndef MSGPACK_UNPACKER_STACK_DEPTH_MAX_DEFAULT
+#define MSGPACK_UNPACKER_STACK_DEPTH_MAX_DEFAULT 128
 #endif
 
 struct msgpack_unpacker_t;
@@ -48,6 +54,7 @@ struct msgpack_unpacker_t {
     msgpack_unpacker_stack_t* stack;
     size_t stack_depth;
     size_t stack_capacity;
+    size_t stack_depth_max;
 
     VALUE last_object;
 
@@ -55,6 +62,17 @@ struct msgpack_unpacker_t {
     size_t reading_raw_remaining;
 
     VALUE buffer_ref;
+
+    /* keys of the maps being read by msgpack_unpacker_read_into, and a
+     * set of the keys of one map to find the stale entries of its target */
+    VALUE read_into_keys;
+    VALUE read_into_set;
+
+    /* NULL until a string or symbol is interned */
+    msgpack_intern_table_t* intern;
+    msgpack_intern_table_t* symbols;
+    bool intern_values;
+    bool symbolize_keys;
 };
 
 #define UNPACKER_BUFFER_(uk) (&(uk)->buffer)
@@ -77,6 +95,27 @@ void msgpack_unpacker_mark(msgpack_unpacker_t* uk);
 
 void msgpack_unpacker_reset(msgpack_unpacker_t* uk);
 
+/* restores the settings given by options to their defaults */
+void msgpack_unpacker_reset_options(msgpack_unpacker_t* uk);
+
+/* interns short string values as well as map keys */
+static inline void msgpack_unpacker_set_intern_values(msgpack_unpacker_t* uk, bool enable)
+{
+    uk->intern_values = enable;
+}
+
+/* containers nested deeper than _depth_ raise StackError */
+static inline void msgpack_unpacker_set_max_depth(msgpack_unpacker_t* uk, size_t depth)
+{
+    uk->stack_depth_max = depth;
+}
+
+/* decodes String keys of maps as Symbols */
+static inline void msgpack_unpacker_set_symbolize_keys(msgpack_unpacker_t* uk, bool enable)
+{
+    uk->symbolize_keys = enable;
+}
+
 
 /* error codes */
 #define PRIMITIVE_CONTAINER_START 1
@@ -85,11 +124,76 @@ void msgpack_unpacker_reset(msgpack_unpacker_t* uk);
 #define PRIMITIVE_INVALID_BYTE -2
 #define PRIMITIVE_STACK_TOO_DEEP -3
 #define PRIMITIVE_UNEXPECTED_TYPE -4
+#define PRIMITIVE_EXTRA_BYTES -5
 
 int msgpack_unpacker_read(msgpack_unpacker_t* uk, size_t target_stack_depth);
 
 int msgpack_unpacker_skip(msgpack_unpacker_t* uk, size_t target_stack_depth);
 
+/*
+ * Reads an object keeping only the parts selected by _projection_.
+ * _projection_ is a Hash from keys of maps or indexes of arrays (or :*
+ * for any) to Hashes selecting parts of the values in turn, or to true
+ * to keep the values as a whole. Other values are skipped.
+ * Unlike msgpack_unpacker_read, it can't resume after PRIMITIVE_EOF.
+ */
+int msgpack_unpacker_read_projected(msgpack_unpacker_t* uk, VALUE projection);
+
+/*
+ * Reads an array of maps into _columns_, a Hash from each key of the maps
+ * to an Array of its values by row, nil where a row lacks the key.
+ * Rows don't become Hashes. Returns PRIMITIVE_EOF without consuming
+ * anything unless the whole array is buffered, and skips the array if a
+ * row isn't a map, so that it can be called again after either.
+ */
+int msgpack_unpacker_read_columns(msgpack_unpacker_t* uk, VALUE columns);
+
+/*
+ * Reads the next object into _target_, an Array or a Hash of the same type
+ * as the object, instead of a new one. Entries of _target_ which the object
+ * doesn't have are removed, and Arrays and Hashes at the same index or
+ * key are refilled in turn. Returns PRIMITIVE_UNEXPECTED_TYPE, leaving the
+ * object to be read, if the types don't match. Returns PRIMITIVE_EOF
+ * without touching _target_ unless the whole object is buffered.
+ */
+int msgpack_unpacker_read_into(msgpack_unpacker_t* uk, VALUE target);
+
+/*
+ * Checks that _data_ is exactly one well-formed object nested at most
+ * _depth_max_ deep, without creating any object. Returns
+ * PRIMITIVE_OBJECT_COMPLETE or the error msgpack_unpacker_read would run
+ * into; PRIMITIVE_EOF also covers lengths and counts larger than the
+ * rest of the data.
+ */
+int msgpack_unpacker_validate(const char* data, size_t length, size_t depth_max);
+
+/*
+ * A structural tape has an entry for every value of an object, in the
+ * order they're serialized: a map or an array is followed by the entries
+ * of its children, so its first child is the next entry and the next
+ * sibling of any value is at _next_. The type of a value is given by the
+ * byte at _offset_.
+ */
+typedef struct {
+    size_t offset;  /* of the head byte */
+    size_t next;    /* index of the entry after the subtree */
+} msgpack_unpacker_tape_entry_t;
+
+typedef struct {
+    msgpack_unpacker_tape_entry_t* entries;
+    size_t count;
+    size_t capacity;
+} msgpack_unpacker_tape_t;
+
+/*
+ * Validates _data_ as msgpack_unpacker_validate and records its tape.
+ * _tape_ is zero-initialized or reused.
+ */
+int msgpack_unpacker_build_tape(const char* data, size_t length, size_t depth_max,
+        msgpack_unpacker_tape_t* tape);
+
+void msgpack_unpacker_tape_destroy(msgpack_unpacker_tape_t* tape);
+
 static inline VALUE msgpack_unpacker_get_last_object(msgpack_unpacker_t* uk)
 {
     return uk->last_object;
@@ -104,5 +208,19 @@ int msgpack_unpacker_read_array_header(msgpack_unpacker_t* uk, uint32_t* result_
 
 int msgpack_unpacker_read_map_header(msgpack_unpacker_t* uk, uint32_t* result_size);
 
+/*
+ * Reads a nil, boolean, integer or float only if the next object is of
+ * _type_; otherwise returns PRIMITIVE_UNEXPECTED_TYPE and leaves it to be
+ * read. The object is the last object as with msgpack_unpacker_read.
+ */
+int msgpack_unpacker_read_scalar(msgpack_unpacker_t* uk, enum msgpack_unpacker_object_type type);
+
+/*
+ * Reads a raw into _string_, replacing its content, without allocating
+ * another String. After PRIMITIVE_EOF, a call with the same _string_
+ * resumes reading; the caller must not pass another one meanwhile.
+ */
+int msgpack_unpacker_read_string_into(msgpack_unpacker_t* uk, VALUE string);
+
 #endif
 
@@ -17,15 +17,14 @@
  */
 
 #include "packsnap.h"
-#include "snappy.h"
 #include "unpacker.hh"
 #include "unpacker_class.hh"
 #include "buffer_class.hh"
+#include "lazy_class.hh"
 
 VALUE cMessagePack_Unpacker;
 
-static VALUE s_unpacker_value;
-static msgpack_unpacker_t* s_unpacker;
+static ID s_unpacker_key;
 
 static VALUE eUnpackError;
 static VALUE eMalformedFormatError;
@@ -37,7 +36,8 @@ static VALUE eTypeError;
     Data_Get_Struct(from, msgpack_unpacker_t, name); \
     if(name == NULL) { \
         rb_raise(rb_eArgError, "NULL found for " # name " when shouldn't be."); \
-    }
+    } \
+    msgpack_buffer_check_nogvl(UNPACKER_BUFFER_(name));
 
 static void Unpacker_free(msgpack_unpacker_t* uk)
 {
@@ -60,6 +60,30 @@ static VALUE Unpacker_alloc(VALUE klass)
     return self;
 }
 
+static void Unpacker_set_options(msgpack_unpacker_t* uk, VALUE options)
+{
+    if(options == Qnil) {
+        return;
+    }
+
+    VALUE v;
+
+    v = rb_hash_aref(options, ID2SYM(rb_intern("intern_values")));
+    msgpack_unpacker_set_intern_values(uk, RTEST(v));
+
+    v = rb_hash_aref(options, ID2SYM(rb_intern("symbolize_keys")));
+    msgpack_unpacker_set_symbolize_keys(uk, RTEST(v));
+
+    v = rb_hash_aref(options, ID2SYM(rb_intern("max_depth")));
+    if(v != Qnil) {
+        long depth = NUM2LONG(v);
+        if(depth <= 0) {
+            rb_raise(rb_eArgError, "max_depth must be positive");
+        }
+        msgpack_unpacker_set_max_depth(uk, (size_t) depth);
+    }
+}
+
 static VALUE Unpacker_initialize(int argc, VALUE* argv, VALUE self)
 {
     VALUE io = Qnil;
@@ -92,12 +116,12 @@ static VALUE Unpacker_initialize(int argc, VALUE* argv, VALUE self)
         MessagePack_Buffer_initialize(UNPACKER_BUFFER_(uk), io, options);
     }
 
-    // TODO options
+    Unpacker_set_options(uk, options);
 
     return self;
 }
 
-static void raise_unpacker_error(int r)
+void MessagePack_Unpacker_raise_error(int r)
 {
     switch(r) {
     case PRIMITIVE_EOF:
@@ -108,6 +132,8 @@ static void raise_unpacker_error(int r)
         rb_raise(eStackError, "stack level too deep");
     case PRIMITIVE_UNEXPECTED_TYPE:
         rb_raise(eTypeError, "unexpected type");
+    case PRIMITIVE_EXTRA_BYTES:
+        rb_raise(eMalformedFormatError, "extra bytes follow after a deserialized object");
     default:
         rb_raise(eUnpackError, "logically unknown error %d", r);
     }
@@ -125,7 +151,7 @@ static VALUE Unpacker_read(VALUE self)
 
     int r = msgpack_unpacker_read(uk, 0);
     if(r < 0) {
-        raise_unpacker_error(r);
+        MessagePack_Unpacker_raise_error(r);
     }
 
     return msgpack_unpacker_get_last_object(uk);
@@ -137,7 +163,7 @@ static VALUE Unpacker_skip(VALUE self)
 
     int r = msgpack_unpacker_skip(uk, 0);
     if(r < 0) {
-        raise_unpacker_error(r);
+        MessagePack_Unpacker_raise_error(r);
     }
 
     return Qnil;
@@ -149,7 +175,7 @@ static VALUE Unpacker_skip_nil(VALUE self)
 
     int r = msgpack_unpacker_skip_nil(uk);
     if(r < 0) {
-        raise_unpacker_error(r);
+        MessagePack_Unpacker_raise_error(r);
     }
 
     if(r) {
@@ -165,7 +191,7 @@ static VALUE Unpacker_read_array_header(VALUE self)
     uint32_t size;
     int r = msgpack_unpacker_read_array_header(uk, &size);
     if(r < 0) {
-        raise_unpacker_error(r);
+        MessagePack_Unpacker_raise_error(r);
     }
 
     return ULONG2NUM(size);
@@ -178,7 +204,7 @@ static VALUE Unpacker_read_map_header(VALUE self)
     uint32_t size;
     int r = msgpack_unpacker_read_map_header(uk, &size);
     if(r < 0) {
-        raise_unpacker_error((int)r);
+        MessagePack_Unpacker_raise_error((int)r);
     }
 
     return ULONG2NUM(size);
@@ -190,36 +216,123 @@ static VALUE Unpacker_peek_next_type(VALUE self)
 
     int r = msgpack_unpacker_peek_next_object_type(uk);
     if(r < 0) {
-        raise_unpacker_error(r);
+        MessagePack_Unpacker_raise_error(r);
     }
 
     switch((enum msgpack_unpacker_object_type) r) {
     case TYPE_NIL:
-        return rb_intern("nil");
+        return ID2SYM(rb_intern("nil"));
     case TYPE_BOOLEAN:
-        return rb_intern("boolean");
+        return ID2SYM(rb_intern("boolean"));
     case TYPE_INTEGER:
-        return rb_intern("integer");
+        return ID2SYM(rb_intern("integer"));
     case TYPE_FLOAT:
-        return rb_intern("float");
+        return ID2SYM(rb_intern("float"));
     case TYPE_RAW:
-        return rb_intern("raw");
+        return ID2SYM(rb_intern("raw"));
     case TYPE_ARRAY:
-        return rb_intern("array");
+        return ID2SYM(rb_intern("array"));
     case TYPE_MAP:
-        return rb_intern("map");
+        return ID2SYM(rb_intern("map"));
     default:
         rb_raise(eUnpackError, "logically unknown type %d", r);
     }
 }
 
+static VALUE Unpacker_read_scalar(VALUE self, enum msgpack_unpacker_object_type type)
+{
+    UNPACKER(self, uk);
+
+    int r = msgpack_unpacker_read_scalar(uk, type);
+    if(r < 0) {
+        MessagePack_Unpacker_raise_error(r);
+    }
+
+    return msgpack_unpacker_get_last_object(uk);
+}
+
+static VALUE Unpacker_read_int(VALUE self)
+{
+    return Unpacker_read_scalar(self, TYPE_INTEGER);
+}
+
+static VALUE Unpacker_read_float(VALUE self)
+{
+    return Unpacker_read_scalar(self, TYPE_FLOAT);
+}
+
+static VALUE Unpacker_read_bool(VALUE self)
+{
+    return Unpacker_read_scalar(self, TYPE_BOOLEAN);
+}
+
+static VALUE Unpacker_read_string_into(VALUE self, VALUE string)
+{
+    UNPACKER(self, uk);
+
+    StringValue(string);
+    rb_str_modify(string);
+
+    /* a raw cut short by EOFError is resumed in the String holding its start */
+    if(uk->reading_raw_remaining > 0 && uk->reading_raw != string) {
+        rb_raise(rb_eArgError, "a raw cut short by EOFError is being read into another String");
+    }
+
+    int r = msgpack_unpacker_read_string_into(uk, string);
+    if(r < 0) {
+        MessagePack_Unpacker_raise_error(r);
+    }
+
+    return string;
+}
+
+static VALUE Unpacker_read_columns(VALUE self)
+{
+    UNPACKER(self, uk);
+
+    size_t depth = uk->stack_depth;
+    VALUE columns = rb_hash_new();
+    int r = msgpack_unpacker_read_columns(uk, columns);
+    if(r < 0) {
+        /* drop the rows being read */
+        uk->stack_depth = depth;
+        MessagePack_Unpacker_raise_error(r);
+    }
+
+    return columns;
+}
+
+static VALUE Unpacker_read_into(VALUE self, VALUE target)
+{
+    UNPACKER(self, uk);
+
+    if(rb_type(target) != T_ARRAY && rb_type(target) != T_HASH) {
+        rb_raise(rb_eArgError, "target must be an Array or a Hash");
+    }
+    rb_check_frozen(target);
+
+    size_t depth = uk->stack_depth;
+    int r = msgpack_unpacker_read_into(uk, target);
+    if(r < 0) {
+        /* drop the containers being read */
+        uk->stack_depth = depth;
+        MessagePack_Unpacker_raise_error(r);
+    }
+
+    return target;
+}
+
 static VALUE Unpacker_feed(VALUE self, VALUE data)
 {
     UNPACKER(self, uk);
 
     StringValue(data);
 
-    msgpack_buffer_append_string(UNPACKER_BUFFER_(uk), data);
+    if(UNPACKER_BUFFER_(uk)->framed) {
+        msgpack_buffer_feed_frames(UNPACKER_BUFFER_(uk), RSTRING_PTR(data), RSTRING_LEN(data));
+    } else {
+        msgpack_buffer_append_string(UNPACKER_BUFFER_(uk), data);
+    }
 
     return self;
 }
@@ -234,7 +347,7 @@ static VALUE Unpacker_each_impl(VALUE self)
             if(r == PRIMITIVE_EOF) {
                 return Qnil;
             }
-            raise_unpacker_error(r);
+            MessagePack_Unpacker_raise_error(r);
         }
         rb_yield(msgpack_unpacker_get_last_object(uk));
     }
@@ -255,12 +368,12 @@ static VALUE Unpacker_each(VALUE self)
 #endif
 
     if(msgpack_buffer_has_io(UNPACKER_BUFFER_(uk))) {
-        return Unpacker_each_impl(self);
-    } else {
         /* rescue EOFError only if io is set */
         return rb_rescue2((VALUE (*)(...))Unpacker_each_impl, self,
                 (VALUE (*)(...))Unpacker_rescue_EOFError, self,
                 rb_eEOFError, NULL);
+    } else {
+        return Unpacker_each_impl(self);
     }
 }
 
@@ -271,35 +384,243 @@ static VALUE Unpacker_feed_each(VALUE self, VALUE data)
     return Unpacker_each(self);
 }
 
-static VALUE
-_unsnappify(VALUE src)
+/*
+ * Packsnap.unpack uses an unpacker cached in fiber-local storage, so
+ * concurrent calls never share a stack or buffer. It's taken out of the
+ * storage while in use: a nested call on the same fiber (e.g. from the
+ * readpartial of an IO) allocates its own.
+ */
+static VALUE MessagePack_unpack_checkout()
 {
-    VALUE dst;
-    size_t output_length;
+    VALUE thread = rb_thread_current();
+    VALUE self = rb_thread_local_aref(thread, s_unpacker_key);
+    if(self != Qnil) {
+        rb_thread_local_aset(thread, s_unpacker_key, Qnil);
+        return self;
+    }
+
+    self = Unpacker_alloc(cMessagePack_Unpacker);
+    UNPACKER(self, uk);
+    msgpack_buffer_set_write_reference_threshold(UNPACKER_BUFFER_(uk), 0);  /* always prefer reference */
+    return self;
+}
+
+static VALUE MessagePack_unpack_checkin(VALUE self)
+{
+    UNPACKER(self, uk);
+
+    /* don't keep the IO, the result or rmem alive until the next call */
+    msgpack_unpacker_reset(uk);
+    msgpack_buffer_reset_io(UNPACKER_BUFFER_(uk));
+    msgpack_unpacker_reset_options(uk);
+
+    rb_thread_local_aset(rb_thread_current(), s_unpacker_key, self);
+    return Qnil;
+}
+
+struct msgpack_unpack_args_t {
+    VALUE self;
+    VALUE src;
+    VALUE io;
+    VALUE options;
+    bool lazy;
+    bool validate;
+    bool tape;
+    VALUE projection;
+};
 
-    if (!snappy::GetUncompressedLength(RSTRING_PTR(src), RSTRING_LEN(src), &output_length)) {
-        rb_raise(rb_ePacksnap, "packsnap::GetUncompressedLength");
+/*
+ * Validates what's been decompressed into the buffer of _uk_. The bytes
+ * are moved into a String first if they span chunks.
+ */
+static int MessagePack_unpack_validate(msgpack_unpacker_t* uk)
+{
+    msgpack_buffer_t* b = UNPACKER_BUFFER_(uk);
+    size_t length = msgpack_buffer_all_readable_size(b);
+    if(msgpack_buffer_top_readable_size(b) < length) {
+        VALUE string = rb_str_buf_new(length);
+        msgpack_buffer_read_to_string_nonblock(b, string, length);
+        msgpack_buffer_refer_frozen_string(b, rb_obj_freeze(string), 0, length);
     }
+    return msgpack_unpacker_validate(b->read_buffer, length, uk->stack_depth_max);
+}
+
+static VALUE MessagePack_unpack_do(VALUE data)
+{
+    msgpack_unpack_args_t* args = (msgpack_unpack_args_t*) data;
+    UNPACKER(args->self, uk);
 
-    dst = rb_str_new(NULL, output_length);
+    Unpacker_set_options(uk, args->options);
+
+    if(args->io != Qnil) {
+        MessagePack_Buffer_initialize(UNPACKER_BUFFER_(uk), args->io, Qnil);
+        msgpack_buffer_set_framed(UNPACKER_BUFFER_(uk), true);
+    }
 
-    if (!snappy::RawUncompress(RSTRING_PTR(src), RSTRING_LEN(src), RSTRING_PTR(dst))) {
-        rb_raise(rb_ePacksnap, "packsnap::RawUncompress");
+    if(args->src != Qnil) {
+        /* decompress into memory owned by the buffer. large input is
+         * decompressed without the GVL: freeze it so that other threads
+         * can't modify it meanwhile */
+        VALUE frozen = rb_str_new_frozen(args->src);
+        msgpack_buffer_append_compressed(UNPACKER_BUFFER_(uk),
+                RSTRING_PTR(frozen), RSTRING_LEN(frozen), SIZE_MAX);
+        RB_GC_GUARD(frozen);
     }
 
-    return dst;
+    if(args->validate) {
+        int r = MessagePack_unpack_validate(uk);
+        if(r < 0) {
+            MessagePack_Unpacker_raise_error(r);
+        }
+    }
+
+    if(args->lazy) {
+        /* views refer the decompressed bytes as long as they live */
+        msgpack_buffer_t* b = UNPACKER_BUFFER_(uk);
+        size_t length = msgpack_buffer_all_readable_size(b);
+        VALUE source = rb_str_buf_new(length);
+        msgpack_buffer_read_to_string_nonblock(b, source, length);
+        rb_obj_freeze(source);
+        return MessagePack_Lazy_new(source, args->tape, uk->stack_depth_max);
+    }
+
+    int r;
+    if(args->projection != Qnil) {
+        r = msgpack_unpacker_read_projected(uk, args->projection);
+    } else {
+        r = msgpack_unpacker_read(uk, 0);
+    }
+    if(r < 0) {
+        MessagePack_Unpacker_raise_error(r);
+    }
+
+    /* raise if extra bytes follow */
+    if(msgpack_buffer_top_readable_size(UNPACKER_BUFFER_(uk)) > 0) {
+        MessagePack_Unpacker_raise_error(PRIMITIVE_EXTRA_BYTES);
+    }
+
+    return msgpack_unpacker_get_last_object(uk);
+}
+
+/* a copy of the projection _node_ which can be modified */
+static VALUE MessagePack_unpack_copy_projection(VALUE node)
+{
+    if(node == Qtrue) {
+        return Qtrue;
+    }
+    VALUE copy = rb_hash_new();
+    VALUE keys = rb_funcall(node, rb_intern("keys"), 0);
+    for(long i = 0; i < RARRAY_LEN(keys); i++) {
+        VALUE key = rb_ary_entry(keys, i);
+        rb_hash_aset(copy, key, MessagePack_unpack_copy_projection(rb_hash_aref(node, key)));
+    }
+    return copy;
+}
+
+/* selects the parts selected by _from_ in _into_ too; true takes it all */
+static VALUE MessagePack_unpack_merge_projection(VALUE into, VALUE from)
+{
+    if(into == Qtrue || from == Qtrue) {
+        return Qtrue;
+    }
+    VALUE keys = rb_funcall(from, rb_intern("keys"), 0);
+    for(long i = 0; i < RARRAY_LEN(keys); i++) {
+        VALUE key = rb_ary_entry(keys, i);
+        VALUE child = rb_hash_lookup2(into, key, Qundef);
+        VALUE other = rb_hash_aref(from, key);
+        rb_hash_aset(into, key, child == Qundef ? MessagePack_unpack_copy_projection(other) :
+                MessagePack_unpack_merge_projection(child, other));
+    }
+    return into;
+}
+
+/*
+ * Merges what :* selects into the keys next to it: a key is looked up
+ * before :*, so it has to select the parts selected by both.
+ */
+static void MessagePack_unpack_spread_wildcard(VALUE node, VALUE wildcard)
+{
+    VALUE any = rb_hash_lookup2(node, wildcard, Qundef);
+    VALUE keys = rb_funcall(node, rb_intern("keys"), 0);
+    for(long i = 0; i < RARRAY_LEN(keys); i++) {
+        VALUE key = rb_ary_entry(keys, i);
+        VALUE child = rb_hash_aref(node, key);
+        if(any != Qundef && key != wildcard) {
+            child = MessagePack_unpack_merge_projection(child, any);
+            rb_hash_aset(node, key, child);
+        }
+        if(child != Qtrue) {
+            MessagePack_unpack_spread_wildcard(child, wildcard);
+        }
+    }
+}
+
+/*
+ * Turns key paths given to the only option into a tree of Hashes for
+ * msgpack_unpacker_read_projected. String keys are compared with
+ * decoded keys as binary strings; Symbols other than :* stand for their
+ * names.
+ */
+static VALUE MessagePack_unpack_compile_projection(VALUE paths)
+{
+    paths = rb_convert_type(paths, T_ARRAY, "Array", "to_ary");
+
+    VALUE wildcard = ID2SYM(rb_intern("*"));
+    VALUE root = rb_hash_new();
+
+    for(long i = 0; i < RARRAY_LEN(paths); i++) {
+        VALUE path = rb_convert_type(rb_ary_entry(paths, i), T_ARRAY, "Array", "to_ary");
+        long length = RARRAY_LEN(path);
+        if(length == 0) {
+            /* the whole object */
+            return Qtrue;
+        }
+
+        VALUE node = root;
+        for(long j = 0; j < length; j++) {
+            VALUE key = rb_ary_entry(path, j);
+            if(SYMBOL_P(key) && key != wildcard) {
+                key = rb_sym2str(key);
+            }
+            if(rb_type(key) == T_STRING) {
+                key = rb_obj_freeze(rb_str_new(RSTRING_PTR(key), RSTRING_LEN(key)));
+            }
+
+            VALUE child = rb_hash_lookup2(node, key, Qundef);
+            if(j == length - 1 || child == Qtrue) {
+                /* a shorter path selects the whole value */
+                rb_hash_aset(node, key, Qtrue);
+                break;
+            }
+            if(child == Qundef) {
+                child = rb_hash_new();
+                rb_hash_aset(node, key, child);
+            }
+            node = child;
+        }
+    }
+
+    MessagePack_unpack_spread_wildcard(root, wildcard);
+    return root;
 }
 
 VALUE MessagePack_unpack(int argc, VALUE* argv)
 {
     VALUE src;
+    VALUE options = Qnil;
 
     switch(argc) {
+    case 2:
+        options = argv[1];
+        if(options != Qnil && rb_type(options) != T_HASH) {
+            rb_raise(rb_eArgError, "expected Hash but found %s.", rb_obj_classname(options));
+        }
+        /* fall through */
     case 1:
         src = argv[0];
         break;
     default:
-        rb_raise(rb_eArgError, "wrong number of arguments (%d for 1)", argc);
+        rb_raise(rb_eArgError, "wrong number of arguments (%d for 1..2)", argc);
     }
 
     VALUE io = Qnil;
@@ -308,36 +629,98 @@ VALUE MessagePack_unpack(int argc, VALUE* argv)
         src = Qnil;
     }
 
-    if (src != Qnil) {
-      src = _unsnappify(src);
-    }
+    bool lazy = false;
+    bool validate = false;
+    bool tape = false;
+    VALUE projection = Qnil;
+    if(options != Qnil) {
+        lazy = RTEST(rb_hash_aref(options, ID2SYM(rb_intern("lazy"))));
+        if(lazy && io != Qnil) {
+            rb_raise(rb_eArgError, "lazy unpacking requires a String");
+        }
+        /* views decode keys and values alone, outside of their maps */
+        if(lazy && RTEST(rb_hash_aref(options, ID2SYM(rb_intern("symbolize_keys"))))) {
+            rb_raise(rb_eArgError, "lazy and symbolize_keys options can't be combined");
+        }
+        if(lazy && RTEST(rb_hash_aref(options, ID2SYM(rb_intern("intern_values"))))) {
+            rb_raise(rb_eArgError, "lazy and intern_values options can't be combined");
+        }
 
-    // TODO create an instance if io is set?; thread safety
-    //VALUE self = Unpacker_alloc(cMessagePack_Unpacker);
-    //UNPACKER(self, uk);
-    msgpack_unpacker_reset(s_unpacker);
-    msgpack_buffer_reset_io(UNPACKER_BUFFER_(s_unpacker));
+        validate = RTEST(rb_hash_aref(options, ID2SYM(rb_intern("validate"))));
+        if(validate && io != Qnil) {
+            rb_raise(rb_eArgError, "validation requires a String");
+        }
 
-    if(io != Qnil) {
-        MessagePack_Buffer_initialize(UNPACKER_BUFFER_(s_unpacker), io, Qnil);
-    }
+        tape = RTEST(rb_hash_aref(options, ID2SYM(rb_intern("tape"))));
+        if(tape && !lazy) {
+            rb_raise(rb_eArgError, "tape option requires lazy");
+        }
 
-    if(src != Qnil) {
-        // TODO prefer zero-copy?
-        msgpack_buffer_append_string(UNPACKER_BUFFER_(s_unpacker), src);
+        VALUE only = rb_hash_aref(options, ID2SYM(rb_intern("only")));
+        if(only != Qnil) {
+            if(lazy) {
+                rb_raise(rb_eArgError, "lazy and only options can't be combined");
+            }
+            projection = MessagePack_unpack_compile_projection(only);
+        }
     }
 
-    int r = msgpack_unpacker_read(s_unpacker, 0);
-    if(r < 0) {
-        raise_unpacker_error(r);
-    }
+    VALUE self = MessagePack_unpack_checkout();
+    msgpack_unpack_args_t args = { self, src, io, options, lazy, validate, tape, projection };
+    return rb_ensure(MessagePack_unpack_do, (VALUE) &args,
+            MessagePack_unpack_checkin, self);
+}
 
-    /* raise if extra bytes follow */
-    if(msgpack_buffer_top_readable_size(UNPACKER_BUFFER_(s_unpacker)) > 0) {
-        rb_raise(eMalformedFormatError, "extra bytes follow after a deserialized object");
+static VALUE MessagePack_valid_do(VALUE data)
+{
+    msgpack_unpack_args_t* args = (msgpack_unpack_args_t*) data;
+    UNPACKER(args->self, uk);
+
+    Unpacker_set_options(uk, args->options);
+
+    VALUE frozen = rb_str_new_frozen(args->src);
+    msgpack_buffer_append_compressed(UNPACKER_BUFFER_(uk),
+            RSTRING_PTR(frozen), RSTRING_LEN(frozen), SIZE_MAX);
+    RB_GC_GUARD(frozen);
+
+    return MessagePack_unpack_validate(uk) == PRIMITIVE_OBJECT_COMPLETE ? Qtrue : Qfalse;
+}
+
+static VALUE MessagePack_valid_rescue(VALUE data, VALUE error)
+{
+    UNUSED(data);
+    UNUSED(error);
+    /* the envelope or the compressed data is broken */
+    return Qfalse;
+}
+
+static VALUE MessagePack_valid_body(VALUE data)
+{
+    return rb_rescue2(MessagePack_valid_do, data,
+            MessagePack_valid_rescue, data,
+            rb_ePacksnap, NULL);
+}
+
+static VALUE MessagePack_valid_p(int argc, VALUE* argv, VALUE mod)
+{
+    UNUSED(mod);
+
+    VALUE options = Qnil;
+    if(argc == 2) {
+        options = argv[1];
+        if(options != Qnil && rb_type(options) != T_HASH) {
+            rb_raise(rb_eArgError, "expected Hash but found %s.", rb_obj_classname(options));
+        }
+    } else if(argc != 1) {
+        rb_raise(rb_eArgError, "wrong number of arguments (%d for 1..2)", argc);
     }
+    VALUE src = argv[0];
+    StringValue(src);
 
-    return msgpack_unpacker_get_last_object(s_unpacker);
+    VALUE self = MessagePack_unpack_checkout();
+    msgpack_unpack_args_t args = { self, src, Qnil, options, false, true, false, Qnil };
+    return rb_ensure(MessagePack_valid_body, (VALUE) &args,
+            MessagePack_unpack_checkin, self);
 }
 
 static VALUE MessagePack_load_module_method(int argc, VALUE* argv, VALUE mod)
@@ -375,18 +758,24 @@ void MessagePack_Unpacker_module_init(VALUE mMessagePack)
     rb_define_method(cMessagePack_Unpacker, "skip_nil", (VALUE (*)(...))Unpacker_skip_nil, 0);
     rb_define_method(cMessagePack_Unpacker, "read_array_header", (VALUE (*)(...))Unpacker_read_array_header, 0);
     rb_define_method(cMessagePack_Unpacker, "read_map_header", (VALUE (*)(...))Unpacker_read_map_header, 0);
-    //rb_define_method(cMessagePack_Unpacker, "peek_next_type", Unpacker_peek_next_type, 0);
+    rb_define_method(cMessagePack_Unpacker, "peek_next_type", (VALUE (*)(...))Unpacker_peek_next_type, 0);
+    rb_define_method(cMessagePack_Unpacker, "read_int", (VALUE (*)(...))Unpacker_read_int, 0);
+    rb_define_method(cMessagePack_Unpacker, "read_float", (VALUE (*)(...))Unpacker_read_float, 0);
+    rb_define_method(cMessagePack_Unpacker, "read_bool", (VALUE (*)(...))Unpacker_read_bool, 0);
+    rb_define_method(cMessagePack_Unpacker, "read_string_into", (VALUE (*)(...))Unpacker_read_string_into, 1);
+    rb_define_method(cMessagePack_Unpacker, "read_columns", (VALUE (*)(...))Unpacker_read_columns, 0);
+    rb_define_method(cMessagePack_Unpacker, "read_into", (VALUE (*)(...))Unpacker_read_into, 1);
     rb_define_method(cMessagePack_Unpacker, "feed", (VALUE (*)(...))Unpacker_feed, 1);
     rb_define_method(cMessagePack_Unpacker, "each", (VALUE (*)(...))Unpacker_each, 0);
     rb_define_method(cMessagePack_Unpacker, "feed_each", (VALUE (*)(...))Unpacker_feed_each, 1);
 
-    s_unpacker_value = Unpacker_alloc(cMessagePack_Unpacker);
-    rb_gc_register_address(&s_unpacker_value);
-    Data_Get_Struct(s_unpacker_value, msgpack_unpacker_t, s_unpacker);
-    msgpack_buffer_set_write_reference_threshold(UNPACKER_BUFFER_(s_unpacker), 0);  /* always prefer reference */
+    s_unpacker_key = rb_intern("__packsnap_unpacker__");
 
     /* MessagePack.unpack(x) */
     rb_define_module_function(mMessagePack, "load", (VALUE (*)(...))MessagePack_load_module_method, -1);
     rb_define_module_function(mMessagePack, "unpack", (VALUE (*)(...))MessagePack_unpack_module_method, -1);
+
+    /* MessagePack.valid?(x) */
+    rb_define_module_function(mMessagePack, "valid?", (VALUE (*)(...))MessagePack_valid_p, -1);
 }
 
@@ -28,5 +28,8 @@ void MessagePack_Unpacker_module_init(VALUE mMessagePack);
 extern "C"
 VALUE MessagePack_unpack(int argc, VALUE* argv);
 
+/* raises the exception for a negative result of msgpack_unpacker_* */
+void MessagePack_Unpacker_raise_error(int r);
+
 #endif
 
@@ -65,6 +65,109 @@ describe Packer do
     io.string.should == "\xc0"
   end
 
+  it 'flush with framed option writes length-prefixed blocks' do
+    io = StringIO.new
+    pk = Packer.new(io, :framed => true)
+    pk.write('a' * (128*1024))
+    pk.flush
+    pk.buffer.size.should == 0
+
+    s = io.string
+    off = 0
+    blocks = 0
+    while off < s.size
+      off += 4 + s[off, 4].unpack('N').first
+      blocks += 1
+    end
+    off.should == s.size
+    blocks.should > 1
+  end
+
+  it 'pack stores payloads below compress_threshold in an envelope' do
+    MessagePack.pack(1).should == "\xff\x81\x00\x01\x01".force_encoding('BINARY')
+
+    raw = MessagePack.pack('a' * 1000, :compress_threshold => 2048)
+    raw[0, 3].should == "\xff\x81\x00".force_encoding('BINARY')
+    MessagePack.unpack(raw).should == 'a' * 1000
+  end
+
+  it 'pack records the codec in the envelope' do
+    obj = ['packsnap' * 100] * 10
+    MessagePack.pack(obj, :codec => :none)[2].should == "\x00"
+
+    raw = MessagePack.pack(obj, :codec => :snappy, :compress_threshold => 0)
+    MessagePack.unpack(raw).should == obj
+
+    lambda {
+      MessagePack.pack(obj, :codec => :unknown)
+    }.should raise_error(ArgumentError)
+  end
+
+  def self.codec_built?(codec)
+    MessagePack.pack(nil, :codec => codec)
+    true
+  rescue ArgumentError
+    false
+  end
+
+  {:lz4 => 2, :zstd => 3}.each do |codec, id|
+    it "pack and unpack round-trip with #{codec}" do
+      obj = {'s' => ['packsnap' * 100] * 10, 'a' => (0...1000).to_a}
+      raw = MessagePack.pack(obj, :codec => codec, :compress_threshold => 0)
+      (raw[2].ord & 0x0f).should == id
+      raw.size.should < MessagePack.pack(obj, :codec => :none).size
+      MessagePack.unpack(raw).should == obj
+    end if codec_built?(codec)
+
+    it "pack and unpack blocks with #{codec} from concurrent threads" do
+      objs = (0...4).map {|t| (0...400_000).map {|i| ['packsnap', t, i] } }
+      threads = objs.map {|obj|
+        Thread.new {
+          (0...2).map {
+            raw = MessagePack.pack(obj, :codec => codec)
+            (raw[2].ord & 0x2f) == (0x20 | id) && MessagePack.unpack(raw) == obj
+          }.all?
+        }
+      }
+      threads.map(&:value).should == [true] * objs.size
+    end if codec_built?(codec)
+  end
+
+  it 'pack doesn\'t carry options over to the next call' do
+    obj = ['packsnap' * 100] * 10
+    MessagePack.pack(obj, :codec => :none)
+    MessagePack.pack(obj).should == MessagePack.pack(obj, :codec => :snappy)
+  end
+
+  it 'pack splits large payloads into blocks' do
+    obj = (0...500_000).map {|i| ['packsnap', i] }
+    raw = MessagePack.pack(obj)
+    (raw[2].ord & 0x20).should == 0x20
+    MessagePack.unpack(raw).should == obj
+  end
+
+  it 'register_dictionary refuses to replace a dictionary' do
+    MessagePack.register_dictionary(1001, 'dictionary' * 10).should == 1001
+    MessagePack.register_dictionary(1001, 'dictionary' * 10).should == 1001
+    lambda {
+      MessagePack.register_dictionary(1001, 'other')
+    }.should raise_error(ArgumentError)
+    lambda {
+      MessagePack.pack(1, :codec => :snappy, :dictionary => 1002)
+    }.should raise_error(ArgumentError, /dictionary 1002 is not registered/)
+  end
+
+  it 'pack and unpack with a trained dictionary' do
+    samples = (0...1000).map {|i| {'id' => i, 'name' => "user#{i}", 'status' => 'active', 'tags' => ['a', 'b']} }
+    MessagePack.register_dictionary(1003, MessagePack.train_dictionary(samples, 4096))
+    obj = {'id' => 5000, 'name' => 'user5000', 'status' => 'active', 'tags' => ['a', 'b']}
+
+    raw = MessagePack.pack(obj, :codec => :zstd, :dictionary => 1003, :compress_threshold => 0)
+    (raw[2].ord & 0x1f).should == 0x13
+    raw.size.should < MessagePack.pack(obj, :codec => :zstd, :compress_threshold => 0).size
+    MessagePack.unpack(raw).should == obj
+  end if codec_built?(:zstd)
+
   it 'buffer' do
     o1 = packer.buffer.object_id
     packer.buffer << 'frsyuki'
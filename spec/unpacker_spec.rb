@@ -1,11 +1,24 @@
 # encoding: ascii-8bit
 require 'spec_helper'
 
+require 'stringio'
+
 describe Unpacker do
   let :unpacker do
     Unpacker.new
   end
 
+  # wraps raw MessagePack bytes in a stored envelope as is
+  def stored(payload)
+    n = payload.bytesize
+    varint = ''
+    while n >= 0x80
+      varint << ((n & 0x7f) | 0x80).chr
+      n >>= 7
+    end
+    "\xff\x81\x00" + varint + n.chr + payload
+  end
+
   # TODO initialize
 
   it 'read_array_header succeeds' do
@@ -48,11 +61,280 @@ describe Unpacker do
     }.should raise_error(EOFError)
   end
 
+  it 'reads records field by field with typed reads' do
+    unpacker.feed("\x94\xcd\x03\xe8\xcb\x3f\xf8\x00\x00\x00\x00\x00\x00\xa3abc\xc3\x9f")
+    buf = ''
+    unpacker.peek_next_type.should == :array
+    unpacker.read_array_header.should == 4
+    unpacker.read_int.should == 1000
+    lambda {
+      unpacker.read_int
+    }.should raise_error(MessagePack::TypeError)
+    unpacker.read_float.should == 1.5
+    unpacker.read_string_into(buf).should equal(buf)
+    buf.should == 'abc'
+    unpacker.read_bool.should == true
+    unpacker.peek_next_type.should == :array
+  end
+
+  it 'read_string_into resumes only with the same String' do
+    buf = ''
+    unpacker.feed("\xa5ab")
+    lambda {
+      unpacker.read_string_into(buf)
+    }.should raise_error(EOFError)
+    lambda {
+      unpacker.read_string_into('')
+    }.should raise_error(ArgumentError)
+    unpacker.feed("cde")
+    unpacker.read_string_into(buf).should equal(buf)
+    buf.should == 'abcde'
+  end
+
+  it 'read_columns reads rows of maps as columns' do
+    # [{'a' => 1, 'b' => 'x'}, {'b' => 'y', 'a' => 2.5}, {'a' => 3, 'c' => [1]}, {}]
+    unpacker.feed("\x94\x82\xa1a\x01\xa1b\xa1x\x82\xa1b\xa1y\xa1a\xcb" + [2.5].pack('G') +
+                  "\x82\xa1a\x03\xa1c\x91\x01\x80")
+    unpacker.read_columns.should ==
+      {'a' => [1, 2.5, 3, nil], 'b' => ['x', 'y', nil, nil], 'c' => [nil, nil, [1], nil]}
+
+    unpacker.feed("\x81\xa1a\x01")
+    lambda {
+      unpacker.read_columns
+    }.should raise_error(MessagePack::TypeError)
+    unpacker.read.should == {'a' => 1}
+  end
+
+  it 'read_columns consumes nothing until the whole array is fed' do
+    # [{'a' => 1, 'b' => 'xyz'}, {'a' => 2, 'b' => 'uvw'}], 7
+    data = "\x92\x82\xa1a\x01\xa1b\xa3xyz\x82\xa1a\x02\xa1b\xa3uvw\x07"
+    unpacker.feed(data[0, 12])
+    lambda {
+      unpacker.read_columns
+    }.should raise_error(EOFError)
+    unpacker.feed(data[12..-1])
+    unpacker.read_columns.should == {'a' => [1, 2], 'b' => ['xyz', 'uvw']}
+    unpacker.read.should == 7
+
+    # a row which isn't a map is skipped with the rest: [{'a' => 1}, 5, {'a' => 2}], 7
+    unpacker.feed("\x93\x81\xa1a\x01\x05\x81\xa1a\x02\x07")
+    lambda {
+      unpacker.read_columns
+    }.should raise_error(MessagePack::TypeError)
+    unpacker.read.should == 7
+  end
+
+  it 'read_into refills the containers of the target' do
+    target = {}
+    # {'a' => [1, 'x'], 'b' => {'c' => 1}, 'd' => 2}
+    unpacker.feed("\x83\xa1a\x92\x01\xa1x\xa1b\x81\xa1c\x01\xa1d\x02")
+    unpacker.read_into(target).should equal(target)
+    target.should == {'a' => [1, 'x'], 'b' => {'c' => 1}, 'd' => 2}
+    a = target['a']
+    b = target['b']
+
+    # fewer keys: {'a' => [2], 'b' => {'e' => 'y'}}
+    unpacker.feed("\x82\xa1a\x91\x02\xa1b\x81\xa1e\xa1y")
+    unpacker.read_into(target)
+    target.should == {'a' => [2], 'b' => {'e' => 'y'}}
+    target['a'].should equal(a)
+    target['b'].should equal(b)
+
+    # a repeated key: {'a' => 1, 'a' => 2}
+    unpacker.feed("\x82\xa1a\x01\xa1a\x02")
+    unpacker.read_into(target)
+    target.should == {'a' => 2}
+
+    unpacker.feed("\x80")
+    lambda {
+      unpacker.read_into([])
+    }.should raise_error(MessagePack::TypeError)
+  end
+
+  it 'read_into leaves the target untouched until the whole object is fed' do
+    target = {'z' => 9}
+    # {'a' => [1, 'x'], 'b' => {'c' => 1}}, 7
+    data = "\x82\xa1a\x92\x01\xa1x\xa1b\x81\xa1c\x01\x07"
+    unpacker.feed(data[0, 7])
+    lambda {
+      unpacker.read_into(target)
+    }.should raise_error(EOFError)
+    target.should == {'z' => 9}
+    unpacker.feed(data[7..-1])
+    unpacker.read_into(target).should == {'a' => [1, 'x'], 'b' => {'c' => 1}}
+    unpacker.read.should == 7
+  end
+
+  it 'read_into leaves Strings taken from the target as they are' do
+    target = {}
+    unpacker.feed("\x81\xa1n\xa3abc")
+    unpacker.read_into(target)
+    s = target['n']
+    unpacker.feed("\x81\xa1n\xa3xyz")
+    unpacker.read_into(target)
+    s.should == 'abc'
+    target['n'].should == 'xyz'
+  end
+
+  it 'skip passes over a value' do
+    unpacker.feed("\x92\x81\xa1k\xcb\x3f\xf8\x00\x00\x00\x00\x00\x00\xda\x00\x03abc\xa8sentinel")
+    unpacker.skip
+    unpacker.read.should == 'sentinel'
+  end
+
+  it 'reads arrays of numbers fed in pieces' do
+    ints = (-32..127).to_a * 3
+    floats = (0...100).map {|i| i * 0.5 }
+    raw = "\x93"
+    raw << "\xdc" + [ints.size].pack('n') + ints.pack('c*')
+    raw << "\xdc" + [floats.size].pack('n') + floats.map {|f| "\xcb" + [f].pack('G') }.join
+    raw << "\x97\x01\x02\xcb" + [1.5].pack('G') + "\xa1x\x03\xcc\xc8\xd0\xdf"
+    obj = [ints, floats, [1, 2, 1.5, 'x', 3, 200, -33]]
+
+    unpacker.feed(raw)
+    unpacker.read.should == obj
+
+    parsed = []
+    raw.scan(/.{1,37}/m) {|seg| unpacker.feed_each(seg) {|o| parsed << o } }
+    parsed.should == [obj]
+  end
+
   # TODO skip methods
   # TODO feed
   # TODO each
   # TODO feed_each
 
+  it 'feed_each decodes framed blocks fed in pieces' do
+    objs = (0...100).map {|i| {'i' => i, 's' => 'v' * (i * 100)} }
+    io = StringIO.new('')
+    pk = Packer.new(io, :framed => true)
+    objs.each {|o| pk.write(o) }
+    pk.flush
+
+    unpacker = Unpacker.new(:framed => true)
+    parsed = []
+    io.string.scan(/.{1,333}/m) do |seg|
+      unpacker.feed_each(seg) {|o| parsed << o }
+    end
+    parsed.should == objs
+  end
+
+  it 'each reads framed blocks from io' do
+    objs = (0...100).map {|i| ['x' * i, i] }
+    io = StringIO.new
+    pk = Packer.new(io, :framed => true)
+    objs.each {|o| pk.write(o) }
+    pk.flush
+    io.rewind
+
+    parsed = []
+    Unpacker.new(io, :framed => true).each {|o| parsed << o }
+    parsed.should == objs
+  end
+
+  it 'MessagePack.unpack is safe to call from concurrent threads' do
+    # large enough to be decompressed without the GVL
+    objs = (0...4).map {|i| {'i' => i, 'v' => 'x' * (i * 300), 'a' => (0..i * 50).to_a, 'b' => ['packsnap'] * 50_000} }
+    threads = objs.map {|obj|
+      Thread.new {
+        io = StringIO.new
+        MessagePack.pack(obj, io)
+        (0...20).map { MessagePack.unpack(StringIO.new(io.string)) == obj }.all?
+      }
+    }
+    threads.map(&:value).should == [true] * objs.size
+  end
+
+  it 'interns map keys and, with intern_values, short values' do
+    raw = MessagePack.pack([{'k' => 'v'}, {'k' => 'v'}])
+    a = MessagePack.unpack(raw)
+    a[0].keys[0].should equal(a[1].keys[0])
+    a[0]['k'].frozen?.should == false
+
+    a = MessagePack.unpack(raw, :intern_values => true)
+    a[0]['k'].should equal(a[1]['k'])
+    a[0]['k'].frozen?.should == true
+  end
+
+  it 'symbolize_keys returns String keys as Symbols' do
+    raw = MessagePack.pack({'a' => {'b' => 1}, 'k' * 100 => 2, 3 => 4})
+    MessagePack.unpack(raw, :symbolize_keys => true).should ==
+      {:a => {:b => 1}, ('k' * 100).to_sym => 2, 3 => 4}
+  end
+
+  it 'MessagePack.unpack with lazy option returns views' do
+    obj = {'user' => {'id' => 1}, 'items' => [{'sku' => 'a'}, {'sku' => 'b'}], 2 => nil}
+    doc = MessagePack.unpack(MessagePack.pack(obj), :lazy => true)
+    doc.class.should == MessagePack::LazyMap
+    doc['user']['id'].should == 1
+    doc[:items][-1]['sku'].should == 'b'
+    doc['items'].map {|i| i['sku'] }.should == ['a', 'b']
+    doc.keys.should == ['user', 'items', 2]
+    doc['none'].should == nil
+    MessagePack.unpack(MessagePack.pack(1), :lazy => true).should == 1
+  end
+
+  it 'MessagePack.unpack with lazy option checks what follows the object' do
+    MessagePack.unpack(stored("\x91\x01"), :lazy => true).to_a.should == [1]
+    lambda {
+      MessagePack.unpack(stored("\x91\x01\xc0garbage"), :lazy => true)
+    }.should raise_error(MessagePack::MalformedFormatError)
+    lambda {
+      MessagePack.unpack(stored("\x91\x01\xc0"), :lazy => true, :tape => true)
+    }.should raise_error(MessagePack::MalformedFormatError)
+    lambda {
+      MessagePack.unpack(stored("\x81\xa1a\x01"), :lazy => true, :symbolize_keys => true)
+    }.should raise_error(ArgumentError)
+    lambda {
+      MessagePack.unpack(stored("\x81\xa1a\x01"), :lazy => true, :intern_values => true)
+    }.should raise_error(ArgumentError)
+  end
+
+  it 'MessagePack.unpack with lazy and tape options finds elements on the tape' do
+    obj = {'a' => [{'b' => (0...50).to_a}, 'x' * 100, {'c' => {'d' => nil}}], 'e' => 1.5}
+    doc = MessagePack.unpack(MessagePack.pack(obj), :lazy => true, :tape => true)
+    doc['a'][0]['b'][49].should == 49
+    doc['a'][2]['c'].keys.should == ['d']
+    doc['e'].should == 1.5
+    lambda {
+      MessagePack.unpack(stored("\x81\xa1a\x92\x01"), :lazy => true, :tape => true)
+    }.should raise_error(EOFError)
+    lambda {
+      MessagePack.unpack(stored("\x93\x01\x02"), :lazy => true, :tape => true)
+    }.should raise_error(EOFError)
+  end
+
+  it 'MessagePack.unpack with only option decodes selected paths' do
+    obj = {'user' => {'id' => 1, 'name' => 'a'}, 'items' => [{'sku' => 'x', 'n' => 1}, {'sku' => 'y'}], 'other' => [1, 2]}
+    MessagePack.unpack(MessagePack.pack(obj), :only => [['user', 'id'], ['items', :*, 'sku']]).should ==
+      {'user' => {'id' => 1}, 'items' => [{'sku' => 'x'}, {'sku' => 'y'}]}
+    MessagePack.unpack(MessagePack.pack(obj), :only => [['items', 1]]).should ==
+      {'items' => [{'sku' => 'y'}]}
+    MessagePack.unpack(MessagePack.pack(obj), :only => [['items', :*, 'sku'], ['items', 0, 'n']]).should ==
+      {'items' => [{'sku' => 'x', 'n' => 1}, {'sku' => 'y'}]}
+  end
+
+  it 'MessagePack.valid? checks the structure' do
+    raw = MessagePack.pack({'a' => [1, 2.5, 'x' * 40]})
+    MessagePack.valid?(raw).should == true
+    MessagePack.valid?(raw[0..-2]).should == false
+    MessagePack.valid?(MessagePack.pack(nil) + "\xc0").should == false
+    MessagePack.valid?('garbage').should == false
+  end
+
+  it 'MessagePack.valid? rejects structural errors' do
+    MessagePack.valid?(stored("\x92\x01\xa1x")).should == true
+    MessagePack.valid?(stored("\x92\x01")).should == false
+    MessagePack.valid?(stored("\x91\xc1")).should == false
+    MessagePack.valid?(stored("\xdd\xff\xff\xff\xff\x01")).should == false
+    MessagePack.valid?(stored("\xc0\xc0")).should == false
+    MessagePack.valid?(stored("\xda\x00\x10abc")).should == false
+
+    deep = "\x91" * 10 + "\xc0"
+    MessagePack.valid?(stored(deep)).should == true
+    MessagePack.valid?(stored(deep), :max_depth => 9).should == false
+  end
+
   it 'buffer' do
     o1 = unpacker.buffer.object_id
     unpacker.buffer << 'frsyuki'
@@ -73,6 +355,20 @@ describe Unpacker do
     }.should raise_error(MessagePack::StackError)
   end
 
+  it 'max_depth option sets the nesting limit' do
+    obj = nil
+    1000.times { obj = [obj] }
+    raw = MessagePack.pack(obj)
+
+    MessagePack.unpack(raw, :max_depth => 1000).should == obj
+    lambda {
+      MessagePack.unpack(raw, :max_depth => 999)
+    }.should raise_error(MessagePack::StackError)
+    lambda {
+      MessagePack.unpack(raw)
+    }.should raise_error(MessagePack::StackError)
+  end
+
   it 'raises invalid byte error' do
     unpacker.feed("\xc6")
     lambda {